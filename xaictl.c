@@ -18,14 +18,53 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <dirent.h>
+#include <ctype.h>
+#include <linux/input.h>
 #include <libusb-1.0/libusb.h>
 
+#ifndef input_event_sec
+#define input_event_sec  time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+/*
+ * USDT static tracepoints (make USDT=1), for bpftrace, perf or SystemTap:
+ *   bpftrace -e 'usdt:./xaictl:xaictl:transfer__end { @[arg0] = count(); }'
+ * Without XAI_USDT, probes expand to nothing.
+ */
+#ifdef XAI_USDT
+#include <sys/sdt.h>
+#define XAI_PROBE2(n, a, b)             DTRACE_PROBE2(xaictl, n, a, b)
+#define XAI_PROBE3(n, a, b, c)          DTRACE_PROBE3(xaictl, n, a, b, c)
+#define XAI_PROBE4(n, a, b, c, d)       DTRACE_PROBE4(xaictl, n, a, b, c, d)
+#define XAI_PROBE5(n, a, b, c, d, e)    DTRACE_PROBE5(xaictl, n, a, b, c, d, e)
+#define XAI_PROBE6(n, a, b, c, d, e, f) DTRACE_PROBE6(xaictl, n, a, b, c, d, e, f)
+#else
+#define XAI_PROBE2(n, a, b)             do { } while (0)
+#define XAI_PROBE3(n, a, b, c)          do { } while (0)
+#define XAI_PROBE4(n, a, b, c, d)       do { } while (0)
+#define XAI_PROBE5(n, a, b, c, d, e)    do { } while (0)
+#define XAI_PROBE6(n, a, b, c, d, e, f) do { } while (0)
+#endif
+
 #define XAI_MOUSE_PROGRAM_NAME    "xaictl"
 #define XAI_MOUSE_PROGRAM_VERSION "2.0"
 
@@ -59,6 +98,7 @@
 #define XAI_MOUSE_LL_GET_PROFILE_SETTINGS  0x04
 #define XAI_MOUSE_LL_SET_CURRENT_PROFILE   0x0C
 #define XAI_MOUSE_LL_GET_CURRENT_PROFILE   0x0D
+#define XAI_MOUSE_LL_HANDSHAKE             0x13
 #define XAI_MOUSE_LL_PING_OR_ACK           0x14
 #define XAI_MOUSE_LL_PONG_OR_RES           0x15
 #define XAI_MOUSE_LL_SET_PROFILE_NAME      0x17
@@ -121,6 +161,11 @@ struct xai_ll_message
 /* USB related */
 #define PACKET_SIZE                64
 #define PACKET_TIMEOUT             1000
+
+/* Answer polling (see xai_device_poll_answer) */
+#define XAI_POLL_DELAY_MIN_US      250
+#define XAI_POLL_DELAY_MAX_US      4000
+#define XAI_POLL_TIMEOUT_US        100000
 #define PACKET_WRITE               (LIBUSB_ENDPOINT_OUT) /* host to device */
 #define PACKET_READ                (LIBUSB_ENDPOINT_IN)  /* device to host */
 
@@ -131,6 +176,10 @@ struct xai_ll_message
 #define RET_ERROR_NO_PERMISSION   -3
 #define RET_ERROR_SYSTEM          -5 /* unknown system error */
 #define RET_ERROR_BUS             -4 /* unknown USB error */
+#define RET_ERROR_VERIFY          -6 /* read back differs from written value */
+#define RET_ERROR_BUSY            -7 /* device locked by another process */
+#define RET_COALESCED              1 /* request served by another session */
+#define RET_PENDING                2 /* asynchronous request in flight */
 
 /* Mask for 'fields' */
 #define PROFILE_FIELD_MASK           0x400000FF
@@ -144,14 +193,31 @@ struct xai_ll_message
 #define PROFILE_FIELD_LCD_BRIGHTNESS 0x40008000
 #define PROFILE_FIELD_LCD_CONTRAST   0x40010000
 #define PROFILE_FIELD_BUTTON_1       0x40020000
-#define PROFILE_FIELD_BUTTON_2       0x40030000
-#define PROFILE_FIELD_BUTTON_3       0x40040000
-#define PROFILE_FIELD_BUTTON_4       0x40080000
-#define PROFILE_FIELD_BUTTON_5       0x40100000
-#define PROFILE_FIELD_BUTTON_6       0x40200000
-#define PROFILE_FIELD_BUTTON_7       0x40400000
-#define PROFILE_FIELD_BUTTON_8       0x40800000
-#define PROFILE_FIELD_BUTTON_9       0x41000000
+#define PROFILE_FIELD_BUTTON_2       0x40040000
+#define PROFILE_FIELD_BUTTON_3       0x40080000
+#define PROFILE_FIELD_BUTTON_4       0x40100000
+#define PROFILE_FIELD_BUTTON_5       0x40200000
+#define PROFILE_FIELD_BUTTON_6       0x40400000
+#define PROFILE_FIELD_BUTTON_7       0x40800000
+#define PROFILE_FIELD_BUTTON_8       0x41000000
+#define PROFILE_FIELD_BUTTON_9       0x42000000
+
+/* One bit per field: BUTTON_2 used to be 0x40030000 (BUTTON_1 | BUTTON_3) */
+#define PROFILE_FIELD_BIT(f)         ((f) & ~0x40000000UL)
+#define PROFILE_FIELD_BUTTON_BIT(n)  (PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_1) << (n))
+
+typedef char xai_profile_field_check[
+        (PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_1) ==
+            PROFILE_FIELD_BIT(PROFILE_FIELD_LCD_CONTRAST) << 1 &&
+         PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_2) == PROFILE_FIELD_BUTTON_BIT(1) &&
+         PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_3) == PROFILE_FIELD_BUTTON_BIT(2) &&
+         PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_4) == PROFILE_FIELD_BUTTON_BIT(3) &&
+         PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_5) == PROFILE_FIELD_BUTTON_BIT(4) &&
+         PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_6) == PROFILE_FIELD_BUTTON_BIT(5) &&
+         PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_7) == PROFILE_FIELD_BUTTON_BIT(6) &&
+         PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_8) == PROFILE_FIELD_BUTTON_BIT(7) &&
+         PROFILE_FIELD_BIT(PROFILE_FIELD_BUTTON_9) == PROFILE_FIELD_BUTTON_BIT(8))
+        ? 1 : -1];
 
 struct xai_profile
 {
@@ -168,21 +234,348 @@ struct xai_profile
     unsigned short button[XAI_MOUSE_BUTTON_NUM];
 };
 
+/* Failure classes (see xai_stats) */
+#define XAI_FAIL_BUS                  0 /* libusb transfer error */
+#define XAI_FAIL_NO_PONG              1 /* no PONG (or ACK) answer in time */
+#define XAI_FAIL_BAD_ID               2 /* answer with another request id */
+#define XAI_FAIL_MISMATCH             3 /* read back value differs */
+#define XAI_FAIL_NUM                  4
+
+struct xai_stats
+{
+    unsigned long transfers;
+    unsigned long retries;       /* answer polled again */
+    unsigned long failures[XAI_FAIL_NUM];
+};
+
+/* Session phases (--timings, see xai_phase_end) */
+#define XAI_PHASE_LIBUSB_INIT         0
+#define XAI_PHASE_ENUMERATE           1 /* find device by vendor/product */
+#define XAI_PHASE_LOCK                2 /* wait for device lock */
+#define XAI_PHASE_CLAIM               3 /* claim (and driver detach) */
+#define XAI_PHASE_WAKE                4 /* device open (runtime resume) */
+#define XAI_PHASE_HANDSHAKE           5
+#define XAI_PHASE_JOURNAL             6 /* interrupted change recovery */
+#define XAI_PHASE_NAMES               7
+#define XAI_PHASE_CONFIGS             8 /* settings parts, current profile */
+#define XAI_PHASE_WRITES              9
+#define XAI_PHASE_FLASH              10
+#define XAI_PHASE_UNINIT             11 /* release, driver reattach */
+#define XAI_PHASE_NUM                12
+
+struct xai_phase
+{
+    unsigned long long us;
+    unsigned long count;
+    unsigned long retries;       /* answer polls and request retries */
+};
+
+/* Simulated device (see xai_sim_transfer) */
+#define XAI_SIM_LATENCY_US          1000
+#define XAI_SIM_WAKE_US            20000
+
+struct xai_sim_bank
+{
+    unsigned char parts[XAI_MOUSE_PROFILE_NUM][3][XAI_MOUSE_LL_DATA_LENGTH];
+    char names[XAI_MOUSE_PROFILE_NUM][XAI_MOUSE_LL_DATA_LENGTH];
+    unsigned char cur_index;
+};
+
+struct xai_sim
+{
+    struct xai_sim_bank ram;
+    struct xai_sim_bank flash;
+    struct xai_ll_message request;   /* last SetReport */
+    struct xai_ll_message response;
+    int pending;                     /* response available for GetReport */
+    int fault_rate;                  /* percent */
+    unsigned int seed;
+    unsigned long flash_writes;
+    int suspended;                   /* runtime suspended (autosuspend) */
+};
+
+/* Runtime power management */
+#define XAI_SYSFS_USB_DEVICES         "/sys/bus/usb/devices"
+
+/* Configuration traffic pacing (--pace) and input report monitor */
+#define XAI_SYSFS_INPUT               "/sys/class/input"
+#define XAI_INPUT_IDLE_US             100000 /* longer gap: mouse not moving */
+
+struct xai_input_monitor
+{
+    pthread_t thread;
+    int fd;
+    volatile int stop;
+    volatile unsigned long interval_us; /* input polling interval (ExactRate) */
+    unsigned long reports;
+    unsigned long gaps;               /* while moving */
+    unsigned long late;               /* gaps longer than 2 intervals */
+    unsigned long long sum_us;
+    unsigned long long max_us;
+    unsigned long long last_us;
+    char path[280];
+};
+
+/*
+ * Cross-process arbitration (one lock file per device). Lock directory
+ * is created at boot (tmpfiles.d): root:plugdev, mode 2770, so only users
+ * allowed to use the mouse can queue requests.
+ */
+#define XAI_LOCK_DIR                  "/run/xaictl"
+#define XAI_LOCK_MAGIC                0x5841494C
+#define XAI_SNAP_MAGIC                0x58414953
+#define XAI_LOCK_TIMEOUT              10   /* seconds */
+#define XAI_LOCK_POLL_US              2000
+#define XAI_LOCK_QUEUE_LEN            32
+
+struct xai_lock_file
+{
+    unsigned int magic;
+    unsigned int next_ticket;
+    unsigned int serving;
+    pid_t queue[XAI_LOCK_QUEUE_LEN];  /* owner of ticket (modulo), 0: abandoned */
+
+    /* last read-only session published a snapshot (see xai_snap_file) */
+    unsigned int snap_valid;
+    unsigned int snap_mark;           /* tickets below were queued before read */
+};
+
+/* Profiles read by last read-only session (requests coalescing) */
+struct xai_snap_file
+{
+    unsigned int magic;
+    unsigned int mark;                /* must match snap_mark of lock file */
+    unsigned char cur_index;
+    struct xai_profile p[XAI_MOUSE_PROFILE_NUM];
+};
+
+/* Write-ahead journal (one file per device) */
+#define XAI_JOURNAL_DIR               "/var/lib/xaictl" /* root */
+#define XAI_JOURNAL_MAGIC             0x5841494A
+#define XAI_JOURNAL_MAX               32
+
+struct xai_journal_header
+{
+    unsigned int magic;
+    unsigned int count;               /* number of entries */
+    unsigned int flash;               /* save to flash when all done */
+};
+
+struct xai_journal_entry
+{
+    struct xai_ll_message msg;
+    unsigned char done;
+} __attribute__((__packed__));
+
+/* Transaction plan (see xai_plan_build) */
+#define XAI_PLAN_MAX                  64
+#define XAI_PLAN_TRIES                3    /* for each read step */
+#define XAI_PLAN_TRANSFER_US          1000 /* estimate, one control transfer */
+
+#define XAI_PLAN_IF_CURRENT           0x01 /* only if current profile is a target */
+#define XAI_PLAN_IF_DIFFERS           0x02 /* only if device content differs */
+#define XAI_PLAN_IF_WRITTEN           0x04 /* only if a settings part was sent */
+
+struct xai_plan_step
+{
+    unsigned char operation;          /* XAI_MOUSE_LL_* */
+    unsigned char part;               /* 1-3 for settings, 0 otherwise */
+    unsigned char index;              /* 0-based profile number */
+    unsigned char flags;
+    struct xai_profile *changes;      /* write steps: requested changes */
+    const unsigned char *data;        /* or settings part content (raw) */
+};
+
+struct xai_plan
+{
+    struct xai_plan_step steps[XAI_PLAN_MAX];
+    int count;
+    int overflow;                     /* steps dropped, plan can't run */
+    unsigned int targets;             /* bit n: profile index n modified */
+    int sent;                         /* write messages sent by last run */
+};
+
+/*
+ * Largest plans: handshake, current profile, 3 reads, 3 writes, name read
+ * and write of each profile, current profile reload, flash. All writes
+ * of a plan must fit in one journal.
+ */
+#define XAI_PLAN_STEPS_WORST          (4 + 8 * XAI_MOUSE_PROFILE_NUM)
+#define XAI_PLAN_WRITES_WORST         (1 + 4 * XAI_MOUSE_PROFILE_NUM)
+
+typedef char xai_plan_max_check[
+        (XAI_PLAN_STEPS_WORST <= XAI_PLAN_MAX) ? 1 : -1];
+typedef char xai_journal_max_check[
+        (XAI_PLAN_WRITES_WORST <= XAI_JOURNAL_MAX) ? 1 : -1];
+
+/*
+ * Asynchronous request (see xai_async_submit): one request in flight
+ * per device, from SetReport to matching answer (or error).
+ */
+#define XAI_ASYNC_IDLE                0
+#define XAI_ASYNC_SEND                1    /* SetReport submitted */
+#define XAI_ASYNC_POLL                2    /* GetReport submitted */
+#define XAI_ASYNC_WAIT                3    /* delay before polling again */
+
+struct xai_context;
+typedef void (*xai_async_cb) (struct xai_context *, struct xai_ll_message *,
+        int, void *);
+
+struct xai_async
+{
+    int state;
+    struct libusb_transfer *transfer;
+    unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + PACKET_SIZE];
+    struct xai_ll_message req;        /* request sent */
+    struct xai_ll_message answer;
+    unsigned char opcode;             /* answer expected, 0: none */
+    unsigned int delay;
+    unsigned long long wake_at;       /* XAI_ASYNC_WAIT: next GetReport */
+    unsigned long long deadline;
+    xai_async_cb done;
+    void *user;
+};
+
 struct xai_context
 {
     libusb_context *libusb_ctx;
     libusb_device_handle *dev;
+    struct xai_sim *sim;         /* simulated device (no libusb) */
+    char devname[32];            /* sysfs like name: bus-port.port */
 
     struct xai_profile p[XAI_MOUSE_PROFILE_NUM];
+    int p_valid;                 /* p[] and cur_index read from device */
+    unsigned char raw[XAI_MOUSE_PROFILE_NUM][3][XAI_MOUSE_LL_DATA_LENGTH];
+    unsigned char raw_valid[XAI_MOUSE_PROFILE_NUM]; /* bit n: raw[][n] known */
     unsigned char cur_id;
     unsigned char cur_index;     /* 0-based profile index */
 
+    struct xai_stats stats;
+    struct xai_phase phases[XAI_PHASE_NUM];
+    unsigned long long phase_start;
+    unsigned long phase_retries;
+
+    int lock_fd;
+    unsigned int lock_ticket;
+    unsigned int lock_mark;
+    int read_only;               /* session will not modify device */
+
+    int journal_fd;
+    int journal_base;            /* journal entry of first message sent */
+
+    char power_control[8];       /* saved power/control value, to restore */
+    unsigned long wake_us;       /* runtime resume latency (0: was active) */
+
+    struct xai_async async;
+
     /* command lines options */
     int usb_debug;
     int usb_rebind;
     int set_current_profile;
+    int fleet;
+    int simulate;
+    int sim_fault_rate;          /* percent */
+    int soak;                    /* number of cycles */
+    int no_flash;
+    int no_lock;
+    int lock_timeout;            /* seconds */
+    int status;                  /* 1: current profile, 2: and its name */
+    int keep_awake;
+    int any_id;                  /* accept answers with another id */
+    int id_warned;
+    int dry_run;
+    int live;
+    int flash_delay;             /* ms, --live */
+    const char *apply_file;      /* --apply */
+    int watch;                   /* seconds, full round of checks */
+    int watch_fix;
+    int daemon;
+    int idle_timeout;            /* seconds, --daemon */
+    int shell;
+    const char *bank_save;       /* --save, bank entry name */
+    const char *bank_load;       /* --load */
+    int bank_list;
+    const char *raw_file;        /* --raw */
+    int timings;
+    const char *timings_file;    /* --timings=FILE (CSV) */
+    int pace;                    /* transfers per input polling interval */
+    int pace_count;              /* transfers in current interval */
+    unsigned long long pace_window;
+    unsigned long pace_waits;
+    unsigned long long pace_wait_us;
+};
+
+/* Fleet mode: one worker thread (and libusb context) per attached mouse */
+#define XAI_FLEET_MAX                 64
+
+struct xai_fleet_worker
+{
+    pthread_t thread;
+    int bus;
+    int address;
+
+    struct xai_context ctx;
+    unsigned int targets;        /* profiles, bit n: 0-based index n */
+    struct xai_profile *changes;
+
+    int ret;
+    unsigned long long elapsed_us;
+    int step;                    /* xai_fleet_status: next request */
+};
+
+/*
+ * Command interpreter state (see xai_session_exec): changes are queued
+ * until a command needs device state, and flash commit is deferred.
+ */
+struct xai_session
+{
+    struct xai_profile pending[XAI_MOUSE_PROFILE_NUM];
+    int dirty;                   /* sent to RAM, not saved to flash */
+    unsigned long long changed_at;
+
+    unsigned long commands;
+    unsigned long batches;
+    unsigned long commits;
+};
+
+/* Raw packet scripts (--raw) */
+#define XAI_RAW_STEP_MAX              512
+
+#define XAI_RAW_SET                   1 /* SetReport */
+#define XAI_RAW_GET                   2 /* GetReport, optional pattern */
+#define XAI_RAW_WAIT                  3 /* GetReport until pattern matches */
+#define XAI_RAW_DELAY                 4
+
+struct xai_raw_step
+{
+    int operation;
+    int line;
+    int len;                          /* pattern length (get, wait) */
+    unsigned long us;                 /* delay, wait timeout */
+    unsigned char data[PACKET_SIZE];
+    unsigned char mask[PACKET_SIZE];  /* 0: wildcard byte (??) */
+};
+
+/* Host-side profile bank (see xai_bank_path) */
+#define XAI_BANK_MAGIC                0x58414942
+#define XAI_BANK_NAME_MAX             64
+
+struct xai_bank_file
+{
+    unsigned int magic;
+    char name[XAI_MOUSE_LL_DATA_LENGTH];  /* profile name */
+    unsigned char parts[3][XAI_MOUSE_LL_DATA_LENGTH];
 };
 
+/* On-demand daemon (--daemon) */
+#define XAI_DAEMON_SOCKET             "/run/xaictl.sock"
+#define XAI_DAEMON_PID_FILE           "/run/xaictl.pid" /* while warm */
+#define XAI_DAEMON_IDLE               30   /* seconds */
+#define XAI_DAEMON_RCV_TIMEOUT        2    /* seconds, for a client request */
+#define XAI_CLIENT_RCV_TIMEOUT        15   /* seconds, daemon start included */
+#define XAI_DAEMON_REQ_MAX            1024
+#define XAI_SESSION_LINE_MAX          256
+
 
 /*
  * Const static data, declarations
@@ -205,921 +598,5418 @@ static const char *button_setup[14] = {
     "Disable"
 };
 
+static const unsigned char init_string[35] = {
+    0x00, 0x13, 0x01, 0x47, 0x45, 0x47, 0x4a, 0x47, 0x59, 0x49, 0x4b, 0x44,
+    0x43, 0x47, 0x42, 0x45, 0x39, 0x44, 0x57, 0x44, 0x4b, 0x42, 0x32, 0x37,
+    0x45, 0x41, 0x41, 0x37, 0x4b, 0x39, 0x5a, 0x35, 0x4A, 0x31, 0x50 };
+
+static const unsigned long button_fields[XAI_MOUSE_BUTTON_NUM] = {
+    PROFILE_FIELD_BUTTON_1, PROFILE_FIELD_BUTTON_2, PROFILE_FIELD_BUTTON_3,
+    PROFILE_FIELD_BUTTON_4, PROFILE_FIELD_BUTTON_5, PROFILE_FIELD_BUTTON_6,
+    PROFILE_FIELD_BUTTON_7, PROFILE_FIELD_BUTTON_8, PROFILE_FIELD_BUTTON_9
+};
+
+/* Profile fields by (long option) name */
+static const struct {
+    const char *name;
+    unsigned long field;
+} field_names[] = {
+    { "name", PROFILE_FIELD_NAME },
+    { "c1", PROFILE_FIELD_CPI1 },
+    { "c2", PROFILE_FIELD_CPI2 },
+    { "rate", PROFILE_FIELD_RATE },
+    { "accel", PROFILE_FIELD_ACCEL },
+    { "aim", PROFILE_FIELD_AIM },
+    { "freemove", PROFILE_FIELD_FREEMOVE },
+    { "lcdb", PROFILE_FIELD_LCD_BRIGHTNESS },
+    { "lcdc", PROFILE_FIELD_LCD_CONTRAST },
+    { "b1", PROFILE_FIELD_BUTTON_1 },
+    { "b2", PROFILE_FIELD_BUTTON_2 },
+    { "b3", PROFILE_FIELD_BUTTON_3 },
+    { "b4", PROFILE_FIELD_BUTTON_4 },
+    { "b5", PROFILE_FIELD_BUTTON_5 },
+    { "b6", PROFILE_FIELD_BUTTON_6 },
+    { "b7", PROFILE_FIELD_BUTTON_7 },
+    { "b8", PROFILE_FIELD_BUTTON_8 },
+    { "b9", PROFILE_FIELD_BUTTON_9 },
+    { NULL, 0 }
+};
+
 /* local prototypes */
+static unsigned long long xai_time_us (void);
+static void xai_phase_begin (struct xai_context *);
+static void xai_phase_end (struct xai_context *, int, int);
+static int xai_timings_report (struct xai_context *, unsigned long long);
+
 static int xai_init (int, int, int, struct xai_context *);
+static int xai_init_device (int, int, int, struct xai_context *);
+static int xai_init_claim (int, struct xai_context *);
 static int xai_uninit (struct xai_context *);
 
-static int xai_device_transfer_packet(libusb_device_handle *, unsigned char [], int);
-static int xai_device_read_packet(libusb_device_handle *, struct xai_ll_message_header *,
+static void xai_devname (libusb_device *, char *, size_t);
+static int xai_power_open (struct xai_context *, libusb_device *);
+static int xai_power_begin (struct xai_context *);
+static void xai_power_end (struct xai_context *);
+
+static void xai_lock_skip_dead (struct xai_lock_file *);
+static void xai_snap_path (struct xai_context *, char *, size_t);
+static int xai_snap_load (struct xai_context *, unsigned int);
+static int xai_snap_store (struct xai_context *);
+static int xai_lock_acquire (struct xai_context *);
+static void xai_lock_release (struct xai_context *);
+
+static int xai_device_transfer_packet(struct xai_context *, unsigned char [], int);
+static unsigned long xai_pace_interval (struct xai_context *);
+static void xai_pace_wait (struct xai_context *);
+static int xai_input_open (char *, size_t);
+static void *xai_input_run (void *);
+static int xai_input_start (struct xai_input_monitor *, struct xai_context *);
+static void xai_input_stop (struct xai_input_monitor *, struct xai_context *);
+static int xai_device_read_packet(struct xai_context *, struct xai_ll_message_header *,
         struct xai_ll_message *);
-static int xai_device_write_packet(libusb_device_handle *, struct xai_ll_message *);
+static int xai_device_write_packet(struct xai_context *, struct xai_ll_message *);
+static unsigned char xai_device_next_id (struct xai_context *);
+static int xai_device_answer_match (struct xai_context *,
+        struct xai_ll_message_header *, unsigned char, struct xai_ll_message *);
+static int xai_device_poll_answer (struct xai_context *,
+        struct xai_ll_message_header *, unsigned char, struct xai_ll_message *);
+
+static int xai_async_submit (struct xai_context *, struct xai_ll_message *,
+        unsigned char, xai_async_cb, void *);
+static int xai_async_transfer (struct xai_context *, int);
+static void LIBUSB_CALL xai_async_usb_cb (struct libusb_transfer *);
+static void xai_async_complete (struct xai_context *, int);
+static int xai_async_pollfds (struct xai_context *, struct pollfd *, int);
+static int xai_async_next_timeout (struct xai_context *);
+static int xai_async_handle_events (struct xai_context *);
+static void xai_async_cancel (struct xai_context *);
+
+static int xai_sim_init (int, struct xai_context *);
+static int xai_sim_transfer (struct xai_sim *, unsigned char [PACKET_SIZE],
+        int);
 
 static int xai_device_packet_print (FILE *, unsigned char [], int);
+static int xai_device_handshake (struct xai_context *);
 static int xai_device_init (struct xai_context *);
+static int xai_device_status (struct xai_context *, int);
+static int xai_device_status_print (FILE *, struct xai_context *, int);
+static int xai_device_send (struct xai_context *, struct xai_ll_message *, int);
 static int xai_device_write_to_flash (struct xai_context *);
 
+static int xai_journal_begin (struct xai_context *, struct xai_ll_message *,
+        int, int);
+static void xai_journal_done (struct xai_context *, int);
+static void xai_journal_end (struct xai_context *);
+static int xai_journal_path (struct xai_context *, char *, size_t);
+static int xai_journal_opcode_valid (unsigned char);
+static int xai_journal_recover (struct xai_context *);
+
 static int xai_profile_get_config (struct xai_context *, int, struct xai_profile *);
+static void xai_profile_decode_part (struct xai_profile *, int,
+        struct xai_ll_message *);
+static void xai_profile_cache_part (struct xai_context *, int, int,
+        struct xai_ll_message *);
+static int xai_profile_read_part (struct xai_context *, int, int,
+        struct xai_ll_message *);
+static int xai_profile_patch_part (struct xai_profile *, int, struct xai_ll_message *);
+static int xai_profile_compose_part (struct xai_context *, int, int,
+        struct xai_profile *, struct xai_ll_message *);
+static int xai_profile_compose_config (struct xai_context *, int,
+        struct xai_profile *, struct xai_ll_message *, int *);
 static int xai_profile_set_config (struct xai_context *, int, struct xai_profile *);
 static int xai_profile_get_current_index (struct xai_context *, int *);
+static void xai_profile_compose_current_index (struct xai_context *, int,
+        struct xai_ll_message *);
 static int xai_profile_set_current_index (struct xai_context *, int);
 static int xai_profile_get_name (struct xai_context *, int, struct xai_profile *);
-static int xai_profile_set_name (struct xai_context *, int, struct xai_profile *);
+static void xai_profile_compose_name (struct xai_context *, int,
+        struct xai_profile *, struct xai_ll_message *);
 static int xai_profile_print (FILE *, struct xai_profile *, int);
 static int xai_profile_change_req (struct xai_profile *, unsigned long, char *);
+static int xai_profile_change_line (struct xai_profile *, char *);
+static int xai_profile_list_parse (const char *, unsigned int *);
+static int xai_profile_apply (struct xai_context *, unsigned int,
+        struct xai_profile *);
+static int xai_profile_verify (struct xai_context *, int, struct xai_profile *);
+
+static void xai_plan_add (struct xai_plan *, unsigned char, int, int, int,
+        struct xai_profile *);
+static void xai_plan_build (struct xai_context *, unsigned int,
+        struct xai_profile *, struct xai_plan *);
+static void xai_plan_build_each (struct xai_context *, struct xai_profile *[],
+        struct xai_plan *);
+static int xai_plan_transfers (struct xai_plan *);
+static void xai_plan_print (FILE *, struct xai_plan *);
+static int xai_plan_run (struct xai_context *, struct xai_plan *);
+static void xai_plan_undo_prepare (struct xai_context *,
+        struct xai_ll_message *, int, unsigned int, struct xai_ll_message *);
+static int xai_plan_rollback (struct xai_context *, struct xai_ll_message *,
+        int, int, int);
+
+static unsigned long xai_profile_diff (const struct xai_profile *,
+        struct xai_profile *);
+static void xai_profile_fields_print (FILE *, unsigned long);
+static int xai_config_load (const char *, struct xai_profile []);
+static int xai_config_apply (struct xai_context *, struct xai_profile []);
+
+static unsigned int xai_watch_fingerprint (
+        unsigned char [3][XAI_MOUSE_LL_DATA_LENGTH], const char *);
+static int xai_watch_open (struct xai_context *);
+static int xai_watch_check (struct xai_context *, int, struct xai_profile *,
+        unsigned int);
+static int xai_watch_run (struct xai_context *, unsigned int);
+
+static int xai_raw_parse_bytes (char *, struct xai_raw_step *, int);
+static int xai_raw_load (const char *, struct xai_raw_step [], int *);
+static int xai_raw_run (struct xai_context *, struct xai_raw_step [], int);
+
+static int xai_bank_path (const char *, char *, size_t, int);
+static int xai_bank_read (const char *, struct xai_bank_file *);
+static int xai_bank_list (FILE *);
+static int xai_bank_save (struct xai_context *, const char *, int);
+static int xai_bank_load (struct xai_context *, const char *, int, FILE *);
+
+static const char *xai_field_name (unsigned long);
+static int xai_session_change (struct xai_session *, unsigned int, char *,
+        FILE *);
+static int xai_session_commit (struct xai_context *, struct xai_session *);
+static int xai_session_flush (struct xai_context *, struct xai_session *);
+static int xai_session_exec (struct xai_context *, struct xai_session *,
+        char *, FILE *);
+
+static int xai_shell_run (struct xai_context *);
+
+static int xai_daemon_listen (int *);
+static int xai_daemon_serve (struct xai_context *, struct xai_session *, int);
+static int xai_daemon_run (struct xai_context *);
+static int xai_daemon_running (void);
+static int xai_client_connect (void);
+static int xai_client_request (int, const char *, int *);
+
+static int xai_soak_run (struct xai_context *, int, int);
+
+static void xai_live_signal (int);
+static int xai_live_apply (struct xai_context *, int, struct xai_profile *);
+static int xai_live_run (struct xai_context *, int, struct xai_profile *);
+
+static int xai_fleet_enumerate (int, int, struct xai_fleet_worker *, int);
+static void *xai_fleet_worker_run (void *);
+static int xai_fleet_run (struct xai_context *, unsigned int,
+        struct xai_profile *);
+static void xai_fleet_status_next (struct xai_context *, struct xai_ll_message *,
+        int, void *);
+static int xai_fleet_status (struct xai_context *);
 
 
 /*
- * Initialize communication channel (libusb stuff) with device.
+ * Monotonic clock, in microseconds
  */
-static int xai_init (int vendor_id, int product_id, int interface,
-        struct xai_context *ctx)
+static unsigned long long xai_time_us (void)
 {
-    int ret = RET_OK;
+    struct timespec ts;
 
-    if (libusb_init(&ctx->libusb_ctx) < 0)
-        return RET_ERROR_SYSTEM;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-    ctx->dev = libusb_open_device_with_vid_pid(ctx->libusb_ctx, vendor_id,
-            product_id);
+/*
+ * Session phases: time spent (and retries taken) in each part of a run,
+ * for --timings. Phases don't nest, a phase can be entered several times.
+ */
+static const char * const phase_names[XAI_PHASE_NUM] = {
+    "libusb_init", "enumerate", "lock wait", "claim/detach", "open/wake",
+    "handshake", "journal", "names", "configs", "writes", "flash", "uninit"
+};
 
-    if (ctx->dev) {
-        if (libusb_claim_interface(ctx->dev, interface) < 0) {
-            if (libusb_detach_kernel_driver(ctx->dev, interface) ==
-                    LIBUSB_SUCCESS) {
-                if ((ret = libusb_claim_interface(ctx->dev, interface)) < 0) {
-                    fprintf(stderr, "err: libusb_claim_interface: %d\n", ret);
-                } else {
-                    return ret;
-                }
-            }
+static void xai_phase_begin (struct xai_context *ctx)
+{
+    ctx->phase_start = xai_time_us();
+    ctx->phase_retries = ctx->stats.retries;
+}
 
-            libusb_close(ctx->dev);
-            libusb_exit(ctx->libusb_ctx);
-            ctx->dev = NULL;
-        }
-    } else {
-        ret = RET_ERROR_NO_DEVICE_FOUND;
-    }
+/*
+ * \param[in] tries Request retries (plan tries loops), poll retries are
+ *                  counted from stats
+ */
+static void xai_phase_end (struct xai_context *ctx, int phase, int tries)
+{
+    struct xai_phase *p = &ctx->phases[phase];
 
-    return ret;
+    p->us += xai_time_us() - ctx->phase_start;
+    p->count++;
+    p->retries += ctx->stats.retries - ctx->phase_retries + tries;
 }
 
 /*
- * Uninitialize communication channel (libusb stuff) with device.
+ * Print phase breakdown (stderr), or append it to --timings file as CSV
+ * (run,phase,count,retries,us; run is start time, in seconds).
+ * \param[in] start Program start (xai_time_us)
  */
-static int xai_uninit (struct xai_context *ctx)
+static int xai_timings_report (struct xai_context *ctx,
+        unsigned long long start)
 {
-    libusb_release_interface(ctx->dev, XAI_MOUSE_INTERFACE_NUM);
+    unsigned long long total = xai_time_us() - start, sum = 0;
+    unsigned long retries = 0;
+    struct xai_phase *p;
+    FILE *out = stderr;
+    long run = (long)time(NULL) - (long)(total / 1000000ULL);
+    int i;
 
-    if (ctx->usb_rebind != 0)
-        libusb_attach_kernel_driver(ctx->dev, XAI_MOUSE_INTERFACE_NUM);
+    if (!ctx->timings)
+        return RET_OK;
 
-    libusb_close(ctx->dev);
-    libusb_exit(ctx->libusb_ctx);
+    if (ctx->timings_file != NULL) {
+        if ((out = fopen(ctx->timings_file, "a")) == NULL) {
+            fprintf(stderr, "%s: can't open %s (%s)\n",
+                    XAI_MOUSE_PROGRAM_NAME, ctx->timings_file,
+                    strerror(errno));
+            return RET_ERROR_SYSTEM;
+        }
+        if (ftell(out) == 0)
+            fprintf(out, "run,phase,count,retries,us\n");
+    } else {
+        fprintf(out, "phase          count  retries          ms      %%\n");
+    }
+
+    for (i = 0; i <= XAI_PHASE_NUM; i++) {
+        p = (i < XAI_PHASE_NUM) ? &ctx->phases[i] : NULL;
+        if (p != NULL && p->count == 0)
+            continue;
+
+        if (p != NULL && ctx->timings_file != NULL)
+            fprintf(out, "%ld,%s,%lu,%lu,%llu\n", run, phase_names[i],
+                    p->count, p->retries, p->us);
+        else if (p != NULL)
+            fprintf(out, "%-13s %6lu %8lu %11.2f %6.1f\n", phase_names[i],
+                    p->count, p->retries, p->us / 1000.0,
+                    total ? 100.0 * p->us / total : 0.0);
+        else if (ctx->timings_file != NULL)
+            fprintf(out, "%ld,total,1,%lu,%llu\n", run, retries, total);
+        else
+            fprintf(out, "%-13s %6s %8s %11.2f %6.1f\n"
+                    "%-13s %6d %8lu %11.2f\n", "other", "", "",
+                    (total - sum) / 1000.0,
+                    total ? 100.0 * (total - sum) / total : 0.0,
+                    "total", 1, retries, total / 1000.0);
+
+        if (p != NULL) {
+            sum += p->us;
+            retries += p->retries;
+        }
+    }
+
+    if (out != stderr)
+        fclose(out);
     return RET_OK;
 }
 
 
 /*
- * Control transfer message (libusb stuff)
- * direction := (PACKET_READ | PACKET_WRITE)
+ * Initialize communication channel (libusb stuff) with device.
  */
-static int xai_device_transfer_packet(libusb_device_handle *dev,
-        unsigned char packet[PACKET_SIZE], int direction)
+static int xai_init (int vendor_id, int product_id, int interface,
+        struct xai_context *ctx)
 {
-    int ret = RET_OK;
+    struct libusb_device_descriptor desc;
+    libusb_device **list;
+    ssize_t i, n;
+    int ret;
 
-    if (direction == PACKET_READ)
-        memset(&packet[0], 0x55, PACKET_SIZE);
+    ctx->lock_fd = -1;
+    ctx->journal_fd = -1;
 
-    if (libusb_control_transfer(dev,
-                LIBUSB_DT_HID | direction,
-                (direction == PACKET_WRITE) ? 0x09 : 0x01, // SetReport / GetReport
-                0x0300,                                    // Feature
-                XAI_MOUSE_INTERFACE_NUM,
-                packet, PACKET_SIZE, PACKET_TIMEOUT) < 0) {
-        fprintf(stderr, "err: libusb_control_transfer\n");
-        ret = RET_ERROR_BUS;
+    xai_phase_begin(ctx);
+    ret = libusb_init(&ctx->libusb_ctx);
+    xai_phase_end(ctx, XAI_PHASE_LIBUSB_INIT, 0);
+    if (ret < 0)
+        return RET_ERROR_SYSTEM;
+
+    xai_phase_begin(ctx);
+    ctx->dev = NULL;
+    ret = RET_ERROR_NO_DEVICE_FOUND;
+    n = libusb_get_device_list(ctx->libusb_ctx, &list);
+
+    for (i = 0; i < n; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) == LIBUSB_SUCCESS &&
+                desc.idVendor == vendor_id && desc.idProduct == product_id)
+            break;
     }
+    xai_phase_end(ctx, XAI_PHASE_ENUMERATE, 0);
 
-    return ret;
-}
+    if (i < n)
+        ret = xai_power_open(ctx, list[i]);
 
-/* For reading a message (64 bytes), we need 2 writes + 2 reads */
-static int xai_device_read_packet(libusb_device_handle *dev,
-        struct xai_ll_message_header *in, struct xai_ll_message *out)
-{
-    int ret;
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
 
-    memset(out, 0, sizeof(struct xai_ll_message));
-    out->header.operation = XAI_MOUSE_LL_PING_OR_ACK;
-    out->header.id        = in->id;
-    out->header.part      = 0;
-    out->header.argument1 = 0;
+    if (ctx->dev == NULL) {
+        libusb_exit(ctx->libusb_ctx);
+        return ret;
+    }
 
-    //ret = xai_device_transfer_packet(dev, (unsigned char *)out, PACKET_WRITE);
-    ret = RET_OK;
-    if (ret == RET_OK) {
-        memset(out, 0, sizeof(struct xai_ll_message));
-        out->header.operation = in->operation;
-        out->header.id        = in->id;
-        out->header.part      = in->part;
-        out->header.argument1 = in->argument1;
+    return xai_init_claim(interface, ctx);
+}
 
-        ret = xai_device_transfer_packet(dev, (unsigned char *)out, PACKET_WRITE);
-        if (ret == RET_OK) {
+/*
+ * Same as xai_init, but open the device sitting at given bus/address
+ * (see xai_fleet_enumerate). A new libusb context is created.
+ */
+static int xai_init_device (int bus, int address, int interface,
+        struct xai_context *ctx)
+{
+    libusb_device **list;
+    ssize_t i, n;
+    int ret = RET_ERROR_NO_DEVICE_FOUND;
 
-            // ret = xai_device_transfer_packet(dev, (unsigned char *)out, PACKET_READ);
-            ret = RET_OK;
-            if (ret == RET_OK) {
+    ctx->lock_fd = -1;
+    ctx->journal_fd = -1;
 
-                //if (in->id != out->id) {
-                //    fprintf(stdout, "ID %X / %X\n", in->id, out->id);
-                //    return RET_ERROR_BUS;
-                //}
+    if (libusb_init(&ctx->libusb_ctx) < 0)
+        return RET_ERROR_SYSTEM;
 
-                ret = xai_device_transfer_packet(dev, (unsigned char *)out,
-                        PACKET_READ);
+    ctx->dev = NULL;
+    n = libusb_get_device_list(ctx->libusb_ctx, &list);
 
-                if (out->header.operation != XAI_MOUSE_LL_PONG_OR_RES) {
-                    usleep(5000);
-                    ret = xai_device_transfer_packet(dev, (unsigned char *)out, PACKET_READ);
-                    //return RET_ERROR_BUS;
-                }
-            }
+    for (i = 0; i < n; i++) {
+        if (libusb_get_bus_number(list[i]) == bus &&
+                libusb_get_device_address(list[i]) == address) {
+            ret = xai_power_open(ctx, list[i]);
+            break;
         }
     }
 
-    return ret;
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+
+    if (ctx->dev == NULL) {
+        libusb_exit(ctx->libusb_ctx);
+        return ret;
+    }
+
+    return xai_init_claim(interface, ctx);
 }
 
-/* For writing a message (64 bytes), we need 1 write + 1 read */
-static int xai_device_write_packet(libusb_device_handle *dev,
-        struct xai_ll_message *in)
+/* Device name, same naming as /sys/bus/usb/devices ("3-1.2") */
+static void xai_devname (libusb_device *d, char *name, size_t size)
 {
-    int ret = RET_ERROR_BUS;
+    unsigned char ports[8];
+    int i, n, len;
+
+    n = libusb_get_port_numbers(d, ports, sizeof(ports));
+    len = snprintf(name, size, "%d", libusb_get_bus_number(d));
+    if (n > 0) {
+        for (i = 0; i < n && len < (int)size; i++)
+            len += snprintf(name + len, size - len,
+                    (i == 0) ? "-%d" : ".%d", ports[i]);
+    } else {
+        snprintf(name + len, size - len, "-addr%d",
+                libusb_get_device_address(d));
+    }
+}
 
-    ret = xai_device_transfer_packet(dev, (unsigned char *)in, PACKET_WRITE);
-    if (ret == RET_OK) {
-        ret = xai_device_transfer_packet(dev, (unsigned char *)in, PACKET_READ);
-        if (ret == RET_OK) {
-            if (in->header.operation != XAI_MOUSE_LL_PING_OR_ACK) {
-                usleep(5000);
-                ret = xai_device_transfer_packet(dev, (unsigned char *)in,
-                        PACKET_READ);
-            }
+/*
+ * Claim interface of an opened device (see xai_power_open), unbind kernel
+ * driver if required. Device lock is taken first (see xai_lock_acquire).
+ * On error, device is closed and libusb context released.
+ */
+static int xai_init_claim (int interface, struct xai_context *ctx)
+{
+    int i, ret = RET_ERROR_NO_PERMISSION;
+
+    xai_phase_begin(ctx);
+    ret = xai_lock_acquire(ctx);
+    xai_phase_end(ctx, XAI_PHASE_LOCK, 0);
+    if (ret != RET_OK)
+        goto init_claim_err;
+
+    xai_phase_begin(ctx);
+    if (libusb_claim_interface(ctx->dev, interface) == LIBUSB_SUCCESS) {
+        xai_phase_end(ctx, XAI_PHASE_CLAIM, 0);
+        return xai_power_begin(ctx);
+    }
+
+    ret = RET_ERROR_NO_PERMISSION;
+    if (libusb_detach_kernel_driver(ctx->dev, interface) == LIBUSB_SUCCESS) {
+        if ((i = libusb_claim_interface(ctx->dev, interface)) < 0) {
+            fprintf(stderr, "%s: can't claim interface %d of device %s "
+                    "(%s)\n", XAI_MOUSE_PROGRAM_NAME, interface,
+                    ctx->devname, libusb_error_name(i));
+        } else {
+            xai_phase_end(ctx, XAI_PHASE_CLAIM, 0);
+            return xai_power_begin(ctx);
         }
     }
 
+    xai_phase_end(ctx, XAI_PHASE_CLAIM, 0);
+    xai_lock_release(ctx);
+
+init_claim_err:
+    libusb_close(ctx->dev);
+    libusb_exit(ctx->libusb_ctx);
+    ctx->dev = NULL;
+
     return ret;
 }
 
-static int xai_device_packet_print (FILE *out, unsigned char packet[PACKET_SIZE],
-        int host_to_device)
+/*
+ * Uninitialize communication channel (libusb stuff) with device.
+ */
+static int xai_uninit (struct xai_context *ctx)
 {
-    int i;
+    xai_phase_begin(ctx);
+    xai_async_cancel(ctx);
+    xai_power_end(ctx);
+
+    if (ctx->sim) {
+        free(ctx->sim);
+        ctx->sim = NULL;
+        xai_lock_release(ctx);
+        xai_phase_end(ctx, XAI_PHASE_UNINIT, 0);
+        return RET_OK;
+    }
 
-    if (host_to_device)
-        fputs("> ", out);
-    else
-        fputs("< ", out);
+    libusb_release_interface(ctx->dev, XAI_MOUSE_INTERFACE_NUM);
 
-    for (i = 0; i < 32; i++) {
-        fprintf(out, "%02X ", packet[i]);
-    }
-    fputs("\n", out);
+    if (ctx->usb_rebind != 0)
+        libusb_attach_kernel_driver(ctx->dev, XAI_MOUSE_INTERFACE_NUM);
+
+    xai_lock_release(ctx);
+
+    libusb_close(ctx->dev);
+    libusb_exit(ctx->libusb_ctx);
+    xai_phase_end(ctx, XAI_PHASE_UNINIT, 0);
     return RET_OK;
 }
 
-/* Read entire mouse configuration */
-static int xai_device_init (struct xai_context *ctx)
-{
-    int i, tries;
-    unsigned char packet[PACKET_SIZE];
 
-    static const unsigned char init_string[35] = {
-        0x00, 0x13, 0x01, 0x47, 0x45, 0x47, 0x4a, 0x47, 0x59, 0x49, 0x4b, 0x44,
-        0x43, 0x47, 0x42, 0x45, 0x39, 0x44, 0x57, 0x44, 0x4b, 0x42, 0x32, 0x37,
-        0x45, 0x41, 0x41, 0x37, 0x4b, 0x39, 0x5a, 0x35, 0x4A, 0x31, 0x50 };
+/*
+ * Runtime power management. When the mouse has been runtime-suspended,
+ * opening it (usbfs) resumes it. Power state is read from sysfs before
+ * the device is opened, and the open itself is timed: this wake-up
+ * latency is measured apart (ctx->wake_us), so protocol timings are not
+ * polluted.
+ * With --keep-awake, autosuspend is disabled for the session
+ * (power/control set to "on") and restored afterwards.
+ */
+static int xai_power_read (struct xai_context *ctx, const char *attr,
+        char *buf, size_t len)
+{
+    char path[128];
+    FILE *f;
 
-    memset(&packet[0], 0, PACKET_SIZE);
-    memcpy(&packet[0], &init_string[0], sizeof(init_string));
+    snprintf(path, sizeof(path), "%s/%s/power/%s", XAI_SYSFS_USB_DEVICES,
+            ctx->devname, attr);
 
-    if (xai_device_transfer_packet(ctx->dev, packet, PACKET_WRITE) == RET_OK) {
-        ctx->cur_id = 0x77;
+    if ((f = fopen(path, "r")) == NULL)
+        return RET_ERROR_SYSTEM;
 
-        for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
-            tries = 3;
-            while ((xai_profile_get_name(ctx, i, &ctx->p[i]) != RET_OK) &&
-                    (tries--));
+    if (fgets(buf, len, f) == NULL)
+        buf[0] = '\0';
+    fclose(f);
 
-            if (tries == 0)
-                goto device_init_err;
-        }
+    buf[strcspn(buf, "\n")] = '\0';
+    return RET_OK;
+}
 
-        for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
-            tries = 3;
-            while ((xai_profile_get_config(ctx, i, &ctx->p[i]) != RET_OK) &&
-                    (tries--));
+static int xai_power_write (struct xai_context *ctx, const char *attr,
+        const char *value)
+{
+    char path[128];
+    FILE *f;
+    int ret = RET_OK;
 
-            if (tries == 0)
-                goto device_init_err;
-        }
+    snprintf(path, sizeof(path), "%s/%s/power/%s", XAI_SYSFS_USB_DEVICES,
+            ctx->devname, attr);
 
-        i = XAI_MOUSE_PROFILE_NUM; // out of bound index
-        if (xai_profile_get_current_index(ctx, &i) != RET_OK)
-            goto device_init_err;
+    if ((f = fopen(path, "w")) == NULL)
+        return RET_ERROR_NO_PERMISSION;
 
-        ctx->cur_index = (unsigned char)i;
-        return RET_OK;
-    }
+    if (fputs(value, f) < 0)
+        ret = RET_ERROR_NO_PERMISSION;
+    if (fclose(f) != 0)
+        ret = RET_ERROR_NO_PERMISSION;
 
-device_init_err:
-    return RET_ERROR_BUS;
+    return ret;
 }
 
 /*
- * Save all settings to flash (current profile index, ...)
+ * Open device: detect power state (device name is set), time the
+ * wake-up. Simulated device is "opened" by xai_sim_init.
  */
-static int xai_device_write_to_flash (struct xai_context *ctx)
+static int xai_power_open (struct xai_context *ctx, libusb_device *d)
 {
-    struct xai_ll_message msg;
+    char state[16];
+    unsigned long long t;
     int ret;
 
-    memset(&msg, 0, sizeof(struct xai_ll_message));
+    xai_devname(d, ctx->devname, sizeof(ctx->devname));
+    if (xai_power_read(ctx, "runtime_status", state, sizeof(state)) != RET_OK)
+        strcpy(state, "unknown");
+
+    xai_phase_begin(ctx);
+    t = xai_time_us();
+    ret = libusb_open(d, &ctx->dev);
+    ctx->wake_us = 0;
+    if (strcmp(state, "suspended") == 0 || strcmp(state, "suspending") == 0)
+        ctx->wake_us = (unsigned long)(xai_time_us() - t);
+    xai_phase_end(ctx, XAI_PHASE_WAKE, 0);
+
+    if (ret != LIBUSB_SUCCESS) {
+        ctx->dev = NULL;
+        return RET_ERROR_NO_PERMISSION;
+    }
 
-    msg.header.operation = XAI_MOUSE_LL_SAVE_TO_FLASH;
-    msg.header.id = ctx->cur_id;
-    ret = xai_device_write_packet(ctx->dev, &msg);
+    if (ctx->usb_debug && ctx->wake_us)
+        fprintf(stderr, "%s: device %s was %s, wake-up took %.2f ms\n",
+                XAI_MOUSE_PROGRAM_NAME, ctx->devname, state,
+                ctx->wake_us / 1000.0);
 
-    if (ctx->usb_debug)
-        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+    return RET_OK;
+}
 
-    return ret;
+/* Session start: hold device awake */
+static int xai_power_begin (struct xai_context *ctx)
+{
+    ctx->power_control[0] = '\0';
+
+    if (ctx->keep_awake) {
+        if (ctx->sim) {
+            strcpy(ctx->power_control, "auto");
+        } else if (xai_power_read(ctx, "control", ctx->power_control,
+                    sizeof(ctx->power_control)) != RET_OK ||
+                xai_power_write(ctx, "control", "on") != RET_OK) {
+            fprintf(stderr, "%s: can't disable autosuspend of device %s\n",
+                    XAI_MOUSE_PROGRAM_NAME, ctx->devname);
+            ctx->power_control[0] = '\0';
+        }
+    }
+
+    return RET_OK;
+}
+
+/* Session end: restore autosuspend setting */
+static void xai_power_end (struct xai_context *ctx)
+{
+    if (ctx->power_control[0] == '\0')
+        return;
+
+    if (ctx->sim) {
+        ctx->sim->suspended = (strcmp(ctx->power_control, "auto") == 0);
+    } else {
+        xai_power_write(ctx, "control", ctx->power_control);
+    }
+
+    ctx->power_control[0] = '\0';
 }
 
 
 /*
- * Fill xai_profile structure : configuration settings
- * \param[in] index 0-based profile number
+ * Cross-process arbitration. Each device has a lock file holding a FIFO
+ * ticket queue, so concurrent invocations are served in arrival order
+ * (no starvation). The file itself is only held (flock) for short
+ * critical sections. Tickets of dead processes are skipped.
+ *
+ * Read-only requests waiting in the queue are coalesced: when a read-only
+ * session, started after they queued, publishes its profiles, they are
+ * served from it and leave the queue without touching the device.
  */
-static int xai_profile_get_config (struct xai_context *ctx, int index,
-        struct xai_profile *profile)
+static int xai_lock_load (int fd, struct xai_lock_file *lf)
 {
-    struct xai_ll_message msg;
-    struct xai_ll_message_header hdr;
-    int ret;
+    if (pread(fd, lf, sizeof(struct xai_lock_file), 0) !=
+            sizeof(struct xai_lock_file) || lf->magic != XAI_LOCK_MAGIC) {
+        memset(lf, 0, sizeof(struct xai_lock_file));
+        lf->magic = XAI_LOCK_MAGIC;
+    }
+    return RET_OK;
+}
 
-    /* Part 1 */
-    hdr.null_byte = 0;
-    hdr.operation = XAI_MOUSE_LL_GET_PROFILE_SETTINGS;
-    hdr.id = ctx->cur_id;
-    hdr.part = 1;
-    hdr.argument1 = (unsigned char)index;
-    hdr.argument2 = 0;
-    ret = xai_device_read_packet(ctx->dev, &hdr, &msg);
+static int xai_lock_store (int fd, struct xai_lock_file *lf)
+{
+    if (pwrite(fd, lf, sizeof(struct xai_lock_file), 0) !=
+            sizeof(struct xai_lock_file))
+        return RET_ERROR_SYSTEM;
+    return RET_OK;
+}
 
-    if (ctx->usb_debug)
-        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+/* Advance queue head over abandoned tickets and dead processes */
+static void xai_lock_skip_dead (struct xai_lock_file *lf)
+{
+    pid_t pid;
 
-    if (ret == RET_OK) {
-        ctx->cur_id = msg.header.id;
-        profile->rate = msg.u.part1.rate;
-        profile->aim = msg.u.part1.aim;
-        profile->accel = msg.u.part1.accel;
-        profile->freemove = msg.u.part1.freemove;
-        profile->lcd_brightness = msg.u.part1.brightness;
-        profile->lcd_contrast = msg.u.part1.contrast;
-
-        /* Part 2 */
-        hdr.null_byte = 0;
-        hdr.operation = XAI_MOUSE_LL_GET_PROFILE_SETTINGS;
-        hdr.id = ctx->cur_id;
-        hdr.part = 2;
-        hdr.argument1 = (unsigned char)index;
-        hdr.argument2 = 0;
-        ret = xai_device_read_packet(ctx->dev, &hdr, &msg);
+    while (lf->serving != lf->next_ticket) {
+        pid = lf->queue[lf->serving % XAI_LOCK_QUEUE_LEN];
+        if (pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH))
+            break;
+        lf->queue[lf->serving % XAI_LOCK_QUEUE_LEN] = 0;
+        lf->serving++;
+    }
+}
 
-        if (ctx->usb_debug)
-            xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+/*
+ * Snapshot of profiles is published in its own file, replaced atomically.
+ * It is only trusted when written by root or by current user (and not
+ * writable by others): a group member can't make others print forged
+ * profiles.
+ */
+static void xai_snap_path (struct xai_context *ctx, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%s-%s.snap", XAI_LOCK_DIR, XAI_MOUSE_PROGRAM_NAME,
+            ctx->devname);
+}
 
-        if (ret == RET_OK) {
-            ctx->cur_id = msg.header.id;
-            profile->cpi[0] = msg.u.part2.cpi1;
-            profile->cpi[1] = msg.u.part2.cpi2;
-
-            /* Part 3 */
-            hdr.null_byte = 0;
-            hdr.operation = XAI_MOUSE_LL_GET_PROFILE_SETTINGS;
-            hdr.id = ctx->cur_id;
-            hdr.part = 3;
-            hdr.argument1 = (unsigned char)index;
-            hdr.argument2 = 0;
-            ret = xai_device_read_packet(ctx->dev, &hdr, &msg);
-
-            if (ctx->usb_debug)
-                xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+static int xai_snap_load (struct xai_context *ctx, unsigned int mark)
+{
+    struct xai_snap_file sf;
+    struct stat st;
+    char path[96];
+    int fd, ret = RET_ERROR_SYSTEM;
 
-            if (ret == RET_OK) {
-                ctx->cur_id = msg.header.id;
-                profile->button[0] = msg.u.part3.button1;
-                profile->button[1] = msg.u.part3.button2;
-                profile->button[2] = msg.u.part3.button3;
-                profile->button[3] = msg.u.part3.button4;
-                profile->button[4] = msg.u.part3.button5;
-                profile->button[5] = msg.u.part3.button6;
-                profile->button[6] = msg.u.part3.button7;
-                profile->button[7] = msg.u.part3.button8;
-                profile->button[8] = msg.u.part3.button9;
-            }
-        }
+    xai_snap_path(ctx, path, sizeof(path));
+    if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        return RET_ERROR_SYSTEM;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (st.st_uid == 0 || st.st_uid == geteuid()) &&
+            !(st.st_mode & (S_IWGRP | S_IWOTH)) &&
+            pread(fd, &sf, sizeof(sf), 0) == sizeof(sf) &&
+            sf.magic == XAI_SNAP_MAGIC && sf.mark == mark &&
+            sf.cur_index < XAI_MOUSE_PROFILE_NUM) {
+        memcpy(ctx->p, sf.p, sizeof(ctx->p));
+        ctx->cur_index = sf.cur_index;
+        ret = RET_OK;
     }
 
-    return RET_OK;
+    close(fd);
+    return ret;
 }
 
-/*
- * Modify profile configuration according to xai_profile structure
- * \param[in] index 0-based profile number
- */
-static int xai_profile_set_config (struct xai_context *ctx, int index,
-        struct xai_profile *profile)
+static int xai_snap_store (struct xai_context *ctx)
 {
-    struct xai_ll_message msg;
-    struct xai_ll_message_header hdr;
-    int touch_flag, ret;
+    struct xai_snap_file sf;
+    char path[96], tmp[112];
+    int fd, ret = RET_OK;
+
+    memset(&sf, 0, sizeof(sf));
+    sf.magic = XAI_SNAP_MAGIC;
+    sf.mark = ctx->lock_mark;
+    sf.cur_index = ctx->cur_index;
+    memcpy(sf.p, ctx->p, sizeof(ctx->p));
+
+    xai_snap_path(ctx, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+            0644);
+    if (fd < 0)
+        return RET_ERROR_SYSTEM;
 
-    /* Part 1 */
-    touch_flag = 0;
-    hdr.null_byte = 0;
-    hdr.operation = XAI_MOUSE_LL_GET_PROFILE_SETTINGS;
-    hdr.id = ctx->cur_id + 1;
-    hdr.part = 1;
-    hdr.argument1 = (unsigned char)index;
-    hdr.argument2 = 0;
-    ret = xai_device_read_packet(ctx->dev, &hdr, &msg);
+    if (write(fd, &sf, sizeof(sf)) != sizeof(sf) || rename(tmp, path) < 0) {
+        unlink(tmp);
+        ret = RET_ERROR_SYSTEM;
+    }
 
-    if (ctx->usb_debug)
-        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+    close(fd);
+    return ret;
+}
 
-    if (ret == RET_OK) {
-        ctx->cur_id = msg.header.id;
+static int xai_lock_acquire (struct xai_context *ctx)
+{
+    struct xai_lock_file lf;
+    struct stat st;
+    char path[96];
+    unsigned long long deadline;
+    pid_t holder;
+    int waiting = 0;
+
+    ctx->lock_fd = -1;
+    if (ctx->no_lock)
+        return RET_OK;
 
-        if ((profile->fields & PROFILE_FIELD_RATE) == PROFILE_FIELD_RATE) {
-            msg.u.part1.rate = profile->rate;
-            touch_flag = 1;
-        }
-        if ((profile->fields & PROFILE_FIELD_AIM) == PROFILE_FIELD_AIM) {
-            msg.u.part1.aim = profile->aim;
-            touch_flag = 1;
-        }
-        if ((profile->fields & PROFILE_FIELD_ACCEL) == PROFILE_FIELD_ACCEL) {
-            msg.u.part1.accel = profile->accel;
-            touch_flag = 1;
-        }
-        if ((profile->fields & PROFILE_FIELD_FREEMOVE) ==
-                PROFILE_FIELD_FREEMOVE) {
-            msg.u.part1.freemove = profile->freemove;
-            touch_flag = 1;
-        }
-        if ((profile->fields & PROFILE_FIELD_LCD_BRIGHTNESS) ==
-                PROFILE_FIELD_LCD_BRIGHTNESS) {
-            msg.u.part1.brightness = profile->lcd_brightness;
-            touch_flag = 1;
-        }
-        if ((profile->fields & PROFILE_FIELD_LCD_CONTRAST) ==
-                PROFILE_FIELD_LCD_CONTRAST) {
-            msg.u.part1.contrast = profile->lcd_contrast;
-            touch_flag = 1;
-        }
+    snprintf(path, sizeof(path), "%s/%s-%s.lock", XAI_LOCK_DIR,
+            XAI_MOUSE_PROGRAM_NAME, ctx->devname);
 
-        if (touch_flag) {
-            msg.header.operation = XAI_MOUSE_LL_SET_PROFILE_SETTINGS;
+    /* no tmpfiles.d entry (installed from source): root creates it */
+    if (geteuid() == 0 && mkdir(XAI_LOCK_DIR, 0770) == 0)
+        chmod(XAI_LOCK_DIR, 02770);
 
-            if (ctx->usb_debug)
-                xai_device_packet_print(stderr, (unsigned char *)&msg, 1);
+    ctx->lock_fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+            0660);
+    if (ctx->lock_fd >= 0 &&
+            (fstat(ctx->lock_fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+        close(ctx->lock_fd);
+        ctx->lock_fd = -1;
+        errno = EINVAL;
+    }
+    /* umask: keep it writable by the group */
+    if (ctx->lock_fd >= 0 && st.st_uid == geteuid())
+        fchmod(ctx->lock_fd, 0660);
+    if (ctx->lock_fd < 0) {
+        fprintf(stderr, "%s: can't open %s (%s), use --no-lock to run "
+                "without serialization\n", XAI_MOUSE_PROGRAM_NAME, path,
+                strerror(errno));
+        return RET_ERROR_NO_PERMISSION;
+    }
 
-            ret = xai_device_write_packet(ctx->dev, &msg);
+    /* take a ticket */
+    flock(ctx->lock_fd, LOCK_EX);
+    xai_lock_load(ctx->lock_fd, &lf);
+    xai_lock_skip_dead(&lf);
+
+    if (lf.next_ticket - lf.serving >= XAI_LOCK_QUEUE_LEN) {
+        flock(ctx->lock_fd, LOCK_UN);
+        close(ctx->lock_fd);
+        ctx->lock_fd = -1;
+        fprintf(stderr, "%s: device %s: too many queued requests\n",
+                XAI_MOUSE_PROGRAM_NAME, ctx->devname);
+        return RET_ERROR_BUSY;
+    }
 
-            if (ctx->usb_debug)
-                xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+    ctx->lock_ticket = lf.next_ticket++;
+    lf.queue[ctx->lock_ticket % XAI_LOCK_QUEUE_LEN] = getpid();
+    xai_lock_store(ctx->lock_fd, &lf);
+    flock(ctx->lock_fd, LOCK_UN);
+
+    deadline = xai_time_us() + ctx->lock_timeout * 1000000ULL;
+
+    for (;;) {
+        flock(ctx->lock_fd, LOCK_EX);
+        xai_lock_load(ctx->lock_fd, &lf);
+        xai_lock_skip_dead(&lf);
+
+        if (ctx->read_only && lf.snap_valid &&
+                (int)(lf.snap_mark - ctx->lock_ticket) > 0 &&
+                xai_snap_load(ctx, lf.snap_mark) == RET_OK) {
+            ctx->p_valid = 1;
+            lf.queue[ctx->lock_ticket % XAI_LOCK_QUEUE_LEN] = 0;
+            xai_lock_store(ctx->lock_fd, &lf);
+            flock(ctx->lock_fd, LOCK_UN);
+            close(ctx->lock_fd);
+            ctx->lock_fd = -1;
+            return RET_COALESCED;
         }
 
-        if (ret == RET_OK)  {
-
-            /* Part 2 */
-            touch_flag = 0;
-            hdr.null_byte = 0;
-            hdr.operation = XAI_MOUSE_LL_GET_PROFILE_SETTINGS;
-            hdr.id = ctx->cur_id + 1;
-            hdr.part = 2;
-            hdr.argument1 = (unsigned char)index;
-            hdr.argument2 = 0;
-            ret = xai_device_read_packet(ctx->dev, &hdr, &msg);
+        if (lf.serving == ctx->lock_ticket) {
+            ctx->lock_mark = lf.next_ticket;
+            xai_lock_store(ctx->lock_fd, &lf);
+            flock(ctx->lock_fd, LOCK_UN);
+            return RET_OK;
+        }
 
-            if (ctx->usb_debug)
-                xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+        holder = lf.queue[lf.serving % XAI_LOCK_QUEUE_LEN];
+
+        if (xai_time_us() >= deadline) {
+            lf.queue[ctx->lock_ticket % XAI_LOCK_QUEUE_LEN] = 0;
+            xai_lock_store(ctx->lock_fd, &lf);
+            flock(ctx->lock_fd, LOCK_UN);
+            close(ctx->lock_fd);
+            ctx->lock_fd = -1;
+            fprintf(stderr, "%s: device %s still in use by pid %d after %d s, "
+                    "giving up\n", XAI_MOUSE_PROGRAM_NAME, ctx->devname,
+                    (int)holder, ctx->lock_timeout);
+            return RET_ERROR_BUSY;
+        }
 
-            if (ret == RET_OK) {
-                ctx->cur_id = msg.header.id;
+        xai_lock_store(ctx->lock_fd, &lf);
+        flock(ctx->lock_fd, LOCK_UN);
 
-                if ((profile->fields & PROFILE_FIELD_CPI1) ==
-                        PROFILE_FIELD_CPI1) {
-                    msg.u.part2.cpi1 = profile->cpi[0];
-                    touch_flag = 1;
-                }
-                if ((profile->fields & PROFILE_FIELD_CPI2) ==
-                        PROFILE_FIELD_CPI2) {
-                    msg.u.part2.cpi2 = profile->cpi[1];
-                    touch_flag = 1;
-                }
+        if (!waiting) {
+            fprintf(stderr, "%s: device %s in use by pid %d, %u request(s) "
+                    "ahead, waiting\n", XAI_MOUSE_PROGRAM_NAME, ctx->devname,
+                    (int)holder, ctx->lock_ticket - lf.serving);
+            waiting = 1;
+        }
 
-                if (touch_flag) {
-                    msg.header.operation = XAI_MOUSE_LL_SET_PROFILE_SETTINGS;
+        usleep(XAI_LOCK_POLL_US);
+    }
+}
 
-                    if (ctx->usb_debug)
-                        xai_device_packet_print(stderr, (unsigned char *)&msg, 1);
+static void xai_lock_release (struct xai_context *ctx)
+{
+    struct xai_lock_file lf;
 
-                    ret = xai_device_write_packet(ctx->dev, &msg);
+    if (ctx->lock_fd < 0)
+        return;
 
-                    if (ctx->usb_debug)
-                        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
-                }
+    flock(ctx->lock_fd, LOCK_EX);
+    xai_lock_load(ctx->lock_fd, &lf);
 
-                if (ret == RET_OK)  {
-
-                    /* Part 3 */
-                    touch_flag = 0;
-                    hdr.null_byte = 0;
-                    hdr.operation = XAI_MOUSE_LL_GET_PROFILE_SETTINGS;
-                    hdr.id = ctx->cur_id;
-                    hdr.part = 3;
-                    hdr.argument1 = (unsigned char)index;
-                    hdr.argument2 = 0;
-                    ret = xai_device_read_packet(ctx->dev, &hdr, &msg);
-
-                    if (ctx->usb_debug)
-                        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
-
-                    if (ret == RET_OK) {
-                        ctx->cur_id = msg.header.id;
-
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_1) ==
-                                PROFILE_FIELD_BUTTON_1) {
-                            msg.u.part3.button1 = profile->button[0];
-                            touch_flag = 1;
-                        }
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_2) ==
-                                PROFILE_FIELD_BUTTON_2) {
-                            msg.u.part3.button2 = profile->button[1];
-                            touch_flag = 1;
-                        }
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_3) ==
-                                PROFILE_FIELD_BUTTON_3) {
-                            msg.u.part3.button3 = profile->button[2];
-                            touch_flag = 1;
-                        }
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_4) ==
-                                PROFILE_FIELD_BUTTON_4) {
-                            msg.u.part3.button4 = profile->button[3];
-                            touch_flag = 1;
-                        }
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_5) ==
-                                PROFILE_FIELD_BUTTON_5) {
-                            msg.u.part3.button5 = profile->button[4];
-                            touch_flag = 1;
-                        }
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_6) ==
-                                PROFILE_FIELD_BUTTON_6) {
-                            msg.u.part3.button6 = profile->button[5];
-                            touch_flag = 1;
-                        }
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_7) ==
-                                PROFILE_FIELD_BUTTON_7) {
-                            msg.u.part3.button7 = profile->button[6];
-                            touch_flag = 1;
-                        }
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_8) ==
-                                PROFILE_FIELD_BUTTON_8) {
-                            msg.u.part3.button8 = profile->button[7];
-                            touch_flag = 1;
-                        }
-                        if ((profile->fields & PROFILE_FIELD_BUTTON_9) ==
-                                PROFILE_FIELD_BUTTON_9) {
-                            msg.u.part3.button9 = profile->button[8];
-                            touch_flag = 1;
-                        }
-
-                        if (touch_flag) {
-                            msg.header.operation = XAI_MOUSE_LL_SET_PROFILE_SETTINGS;
-
-                            if (ctx->usb_debug)
-                                xai_device_packet_print(stderr, (unsigned char *)&msg, 1);
-
-                            ret = xai_device_write_packet(ctx->dev, &msg);
-
-                            if (ctx->usb_debug)
-                                xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
-                        }
+    if (lf.serving == ctx->lock_ticket) {
+        lf.queue[ctx->lock_ticket % XAI_LOCK_QUEUE_LEN] = 0;
+        lf.serving++;
+    }
 
-                    }
-                }
-            }
-        }
+    if (ctx->read_only && ctx->p_valid) {
+        lf.snap_valid = (xai_snap_store(ctx) == RET_OK);
+        lf.snap_mark = ctx->lock_mark;
+    } else if (!ctx->read_only) {
+        lf.snap_valid = 0;
     }
 
-    return ret;
+    xai_lock_store(ctx->lock_fd, &lf);
+    flock(ctx->lock_fd, LOCK_UN);
+    close(ctx->lock_fd);
+    ctx->lock_fd = -1;
 }
 
+
 /*
- * Get profile name
- * \param[in] index 0-based profile number
- * \param[out] profile Will fill profile->name
+ * Control transfer message (libusb stuff)
+ * direction := (PACKET_READ | PACKET_WRITE)
  */
-static int xai_profile_get_name (struct xai_context *ctx, int index,
-        struct xai_profile *profile)
+static int xai_device_transfer_packet(struct xai_context *ctx,
+        unsigned char packet[PACKET_SIZE], int direction)
 {
-    struct xai_ll_message msg;
-    struct xai_ll_message_header hdr;
-    int ret;
+    int ret = RET_OK;
 
-    hdr.null_byte = 0;
-    hdr.operation = XAI_MOUSE_LL_GET_PROFILE_NAME;
-    hdr.id = ctx->cur_id;
-    hdr.part = 0;
-    hdr.argument1 = (unsigned char)index;
-    hdr.argument2 = 0;
-    ret = xai_device_read_packet(ctx->dev, &hdr, &msg);
+    if (ctx->pace > 0)
+        xai_pace_wait(ctx);
 
-    if (ctx->usb_debug)
-        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+    ctx->stats.transfers++;
+    /* opcode, part, profile index: request (reads: as prefilled by caller) */
+    XAI_PROBE5(transfer__start, direction, packet[1], packet[3], packet[4],
+            ctx->cur_id);
 
-    if (ret == RET_OK) {
-        ctx->cur_id = msg.header.id;
-        if (msg.u.data[0] == '\0')
-            profile->name[0] = 0;
-        else
-            strncpy(profile->name, &msg.u.data[0],
-                    XAI_MOUSE_LL_DATA_LENGTH);
+    if (direction == PACKET_READ)
+        memset(&packet[0], 0x55, PACKET_SIZE);
+
+    if (ctx->sim) {
+        ret = xai_sim_transfer(ctx->sim, packet, direction);
+    } else if (libusb_control_transfer(ctx->dev,
+                LIBUSB_DT_HID | direction,
+                (direction == PACKET_WRITE) ? 0x09 : 0x01, // SetReport / GetReport
+                0x0300,                                    // Feature
+                XAI_MOUSE_INTERFACE_NUM,
+                packet, PACKET_SIZE, PACKET_TIMEOUT) < 0) {
+        fprintf(stderr, "err: libusb_control_transfer\n");
+        ret = RET_ERROR_BUS;
     }
+
+    if (ret != RET_OK)
+        ctx->stats.failures[XAI_FAIL_BUS]++;
+
+    /* opcode, part, profile index: sent or received packet */
+    XAI_PROBE6(transfer__end, direction, packet[1], packet[3], packet[4],
+            ctx->cur_id, ret);
     return ret;
 }
 
 /*
- * Set profile name
- * \param[in] index 0-based profile number
- * \param[in] profile New profile name is profile->name
+ * Pacing (--pace=N): a burst of back-to-back control transfers delays
+ * input reports of the mouse (pointer stutter). At most N transfers are
+ * done per input polling interval (from ExactRate of current profile,
+ * 1 ms while it is not known), extra ones wait for next interval.
  */
-static int xai_profile_set_name (struct xai_context *ctx, int index,
-        struct xai_profile *profile)
+static unsigned long xai_pace_interval (struct xai_context *ctx)
 {
-    struct xai_ll_message msg;
-    int ret;
+    int rate = 0;
 
-    memset(&msg, 0, sizeof(struct xai_ll_message));
+    if (ctx->cur_index < XAI_MOUSE_PROFILE_NUM)
+        rate = ctx->p[ctx->cur_index].rate;
+    if (rate < XAI_MOUSE_RATE_MIN || rate > XAI_MOUSE_RATE_MAX)
+        rate = XAI_MOUSE_RATE_MAX;
 
-    msg.header.operation = XAI_MOUSE_LL_SET_PROFILE_NAME;
-    msg.header.id = ctx->cur_id;
-    msg.header.argument1 = (unsigned char)index;
-    strncpy(&msg.u.data[4], profile->name, XAI_MOUSE_LL_DATA_LENGTH);
-    ret = xai_device_write_packet(ctx->dev, &msg);
+    return 1000000UL / rate;
+}
 
-    if (ctx->usb_debug)
-        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+static void xai_pace_wait (struct xai_context *ctx)
+{
+    unsigned long long now = xai_time_us(), end;
+
+    end = ctx->pace_window + xai_pace_interval(ctx);
+    if (now >= end) {
+        ctx->pace_window = now;
+        ctx->pace_count = 0;
+    } else if (ctx->pace_count >= ctx->pace) {
+        usleep(end - now);
+        ctx->pace_waits++;
+        ctx->pace_wait_us += xai_time_us() - now;
+        ctx->pace_window = xai_time_us();
+        ctx->pace_count = 0;
+    }
 
-    return ret;
+    ctx->pace_count++;
 }
 
 /*
- * Get current used profile
- * \param[in] index 0-based profile number
+ * Input report monitor: gaps between input reports (evdev SYN_REPORT) of
+ * the mouse, measured while configuration traffic runs. Gaps longer than
+ * XAI_INPUT_IDLE_US are idle periods (mouse not moving), not counted.
+ * Event device needs read permission (root or "input" group); without
+ * it, nothing is measured.
  */
-static int xai_profile_get_current_index (struct xai_context *ctx, int *index)
-{
-    struct xai_ll_message msg;
-    struct xai_ll_message_header hdr;
-    int ret;
-
-    hdr.null_byte = 0;
-    hdr.operation = XAI_MOUSE_LL_GET_CURRENT_PROFILE;
-    hdr.id = ctx->cur_id;
-    hdr.part = 0;
-    hdr.argument1 = 0;
-    hdr.argument2 = 0;
-    ret = xai_device_read_packet(ctx->dev, &hdr, &msg);
 
-    if (ctx->usb_debug)
-        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+/* Find event device of the mouse pointer interface (relative axes) */
+static int xai_input_open (char *path, size_t len)
+{
+    char buf[64], name[320];
+    unsigned int vendor, product;
+    struct dirent *e;
+    FILE *f;
+    DIR *dir;
+    int fd = -1, ok, found = 0;
+
+    dir = opendir(XAI_SYSFS_INPUT);
+
+    while (dir != NULL && fd < 0 && (e = readdir(dir)) != NULL) {
+        if (strncmp(e->d_name, "event", 5) != 0)
+            continue;
+
+        ok = 0;
+        snprintf(name, sizeof(name), "%s/%s/device/id/vendor",
+                XAI_SYSFS_INPUT, e->d_name);
+        if ((f = fopen(name, "r")) != NULL) {
+            ok = (fscanf(f, "%x", &vendor) == 1 &&
+                    vendor == XAI_MOUSE_VENDOR_ID);
+            fclose(f);
+        }
+        snprintf(name, sizeof(name), "%s/%s/device/id/product",
+                XAI_SYSFS_INPUT, e->d_name);
+        if (ok && (f = fopen(name, "r")) != NULL) {
+            ok = (fscanf(f, "%x", &product) == 1 &&
+                    product == XAI_MOUSE_PRODUCT_ID);
+            fclose(f);
+        }
+        snprintf(name, sizeof(name), "%s/%s/device/capabilities/rel",
+                XAI_SYSFS_INPUT, e->d_name);
+        if (ok && (f = fopen(name, "r")) != NULL) {
+            ok = (fgets(buf, sizeof(buf), f) != NULL && buf[0] != '0');
+            fclose(f);
+        }
 
-    if (ret == RET_OK) {
-        *index = msg.header.part;
-        ctx->cur_id = msg.header.id;
+        if (ok) {
+            found = 1;
+            snprintf(path, len, "/dev/input/%s", e->d_name);
+            if ((fd = open(path, O_RDONLY | O_NONBLOCK)) < 0) {
+                fprintf(stderr, "%s: can't open %s (%s), input timing not "
+                        "measured\n", XAI_MOUSE_PROGRAM_NAME, path,
+                        strerror(errno));
+                break;
+            }
+        }
     }
-    return ret;
+
+    if (dir != NULL)
+        closedir(dir);
+    if (!found)
+        fprintf(stderr, "%s: no input device found, input timing not "
+                "measured\n", XAI_MOUSE_PROGRAM_NAME);
+    return fd;
 }
 
-/*
- * Set current used profile
- * \param[in] index 0-based profile number
- */
-static int xai_profile_set_current_index (struct xai_context *ctx, int index)
+static void *xai_input_run (void *arg)
 {
-    struct xai_ll_message msg;
-    int ret;
+    struct xai_input_monitor *m = arg;
+    struct input_event ev[16];
+    struct pollfd pfd;
+    unsigned long long t, gap;
+    ssize_t n;
+    int i;
 
-    memset(&msg, 0, sizeof(struct xai_ll_message));
+    pfd.fd = m->fd;
+    pfd.events = POLLIN;
 
-    msg.header.operation = XAI_MOUSE_LL_SET_CURRENT_PROFILE;
-    msg.header.id = ctx->cur_id;
-    msg.header.part = (unsigned char)index;
-    ret = xai_device_write_packet(ctx->dev, &msg);
+    while (!m->stop) {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
 
-    if (ctx->usb_debug)
-        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+        /* Event device is gone (unplug): nothing more to measure */
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+            break;
 
-    return ret;
+        while ((n = read(m->fd, ev, sizeof(ev))) > 0) {
+            for (i = 0; i < n / (ssize_t)sizeof(struct input_event); i++) {
+                if (ev[i].type != EV_SYN || ev[i].code != SYN_REPORT)
+                    continue;
+
+                t = (unsigned long long)ev[i].input_event_sec * 1000000ULL +
+                    ev[i].input_event_usec;
+                gap = t - m->last_us;
+                if (m->reports > 0 && gap < XAI_INPUT_IDLE_US) {
+                    m->gaps++;
+                    m->sum_us += gap;
+                    if (gap > m->max_us)
+                        m->max_us = gap;
+                    if (gap > 2 * m->interval_us)
+                        m->late++;
+                }
+                m->last_us = t;
+                m->reports++;
+            }
+        }
+    }
+
+    return NULL;
 }
 
-static int xai_profile_print (FILE *out, struct xai_profile *p, int cur_flag)
+static int xai_input_start (struct xai_input_monitor *m,
+        struct xai_context *ctx)
 {
-    int i, len;
-
-    len = fprintf(out, "%s", p->name);
+    int clk = CLOCK_MONOTONIC;
 
-    if (cur_flag)
-        fputs(" (current)\n", out);
-    else
-        fputc('\n', out);
+    memset(m, 0, sizeof(struct xai_input_monitor));
+    m->interval_us = xai_pace_interval(ctx);
 
-    for (i = 0; i < len; i++)
-        fputc('-', out);
+    if (ctx->simulate ||
+            (m->fd = xai_input_open(m->path, sizeof(m->path))) < 0) {
+        m->fd = -1;
+        return RET_ERROR_NO_DEVICE_FOUND;
+    }
 
-    fprintf(out, "\nCPI1 (led off)  : %d\n"
-            "CPI2 (led on)   : %d\n"
-            "ExactRate (Hz)  : %d\n"
-            "ExactAccel (%%)  : %d\n"
-            "ExactAim  (unit): %d (0x%x)\n"
-            "Free mode (unit): %d (0x%x)\n"
-            "LCD brightness  : %d\n"
-            "LCD contrast    : %d\n\n",
-            p->cpi[0], p->cpi[1], p->rate, p->accel,
-            (p->aim - 0x64)/5, p->aim,
-            (p->freemove - 0x64)/5, p->freemove,
-            p->lcd_brightness, p->lcd_contrast);
+    ioctl(m->fd, EVIOCSCLOCKID, &clk);
 
-    for (i = 0; i < XAI_MOUSE_BUTTON_NUM; i++) {
-        if (p->button[i] < (sizeof(button_setup)/sizeof(char *)))
-            fprintf(out, "Button %d : %s\n", i+1, button_setup[p->button[i]]);
-        else
-            fprintf(out, "Button %d : 0x%x\n", i+1, p->button[i]);
+    if (pthread_create(&m->thread, NULL, xai_input_run, m) != 0) {
+        close(m->fd);
+        m->fd = -1;
+        return RET_ERROR_SYSTEM;
     }
 
-    fputs("\n", out);
     return RET_OK;
 }
 
+/* Stop monitor, print input report timing and pacing summary (stderr) */
+static void xai_input_stop (struct xai_input_monitor *m,
+        struct xai_context *ctx)
+{
+    if (ctx->pace > 0)
+        fprintf(stderr, "%s: pacing: %d transfer(s) per %lu us, %lu "
+                "wait(s), %.2f ms\n", XAI_MOUSE_PROGRAM_NAME, ctx->pace,
+                xai_pace_interval(ctx), ctx->pace_waits,
+                ctx->pace_wait_us / 1000.0);
+
+    if (m->fd < 0)
+        return;
+
+    m->stop = 1;
+    pthread_join(m->thread, NULL);
+    close(m->fd);
+    m->fd = -1;
+    m->interval_us = xai_pace_interval(ctx); /* rate may have changed */
+
+    if (m->gaps == 0) {
+        fprintf(stderr, "%s: input: %s, no motion during session\n",
+                XAI_MOUSE_PROGRAM_NAME, m->path);
+        return;
+    }
+
+    fprintf(stderr, "%s: input: %s, %lu report(s), gap mean %.2f ms, "
+            "max %.2f ms, %lu late (> %.2f ms)\n", XAI_MOUSE_PROGRAM_NAME,
+            m->path, m->reports, m->sum_us / 1000.0 / m->gaps,
+            m->max_us / 1000.0, m->late, 2 * m->interval_us / 1000.0);
+}
 
-/* value match the index in 'button_setup' array */
-static int button_setup_parse(const char *user_input, unsigned short *value)
+
+/*
+ * Transaction ids: each request gets its own id, answer must carry it back
+ */
+static unsigned char xai_device_next_id (struct xai_context *ctx)
 {
-    if (strcasecmp(user_input, "disable") == 0 ||
-            (*user_input == 'd' && *(user_input+1) == '\0')) {
-        *value = 13;
-    } else if (strcasecmp(user_input, "left") == 0 ||
-            (*user_input == 'l' && *(user_input+1) == '\0')) {
-        *value = 9;
-    } else if (strcasecmp(user_input, "right") == 0 ||
-            (*user_input == 'r' && *(user_input+1) == '\0')) {
-        *value = 10;
-    } else if (strcasecmp(user_input, "middle") == 0 ||
-            (*user_input == 'm' && *(user_input+1) == '\0')) {
-        *value = 6;
-    } else if (strcasecmp(user_input, "wheelup") == 0 ||
-            (*user_input == 'u' && *(user_input+1) == 'p' &&
-             *(user_input+2) == '\0')) {
-        *value = 11;
-    } else if (strcasecmp(user_input, "wheeldown") == 0 ||
-            (*user_input == 'd' && *(user_input+1) == 'w' &&
-             *(user_input+2) == '\0')) {
-        *value = 12;
-    } else if (strcasecmp(user_input, "tiltleft") == 0 ||
-            (*user_input == 't' && *(user_input+1) == 'l' &&
-             *(user_input+2) == '\0')) {
-        *value = 2;
-    } else if (strcasecmp(user_input, "tiltright") == 0 ||
-            (*user_input == 't' && *(user_input+1) == 'r' &&
-             *(user_input+2) == '\0')) {
-        *value = 3;
-    } else if (strcasecmp(user_input, "ieforward") == 0 ||
-            (*user_input == 'f' && *(user_input+1) == 'w' &&
-             *(user_input+2) == '\0')) {
-        *value = 4;
-    } else if (strcasecmp(user_input, "iebackward") == 0 ||
-            (*user_input == 'b' && *(user_input+1) == 'w' &&
-             *(user_input+2) == '\0')) {
-        *value = 5;
-    } else {
+    return ++ctx->cur_id;
+}
+
+/*
+ * Is 'answer' the answer to request 'req'? Expected opcode and request id
+ * are required; part reads may be answered with id + 1 (firmware quirk).
+ * Any other report (stale or duplicated answer of a previous request) is
+ * discarded, unless --any-id is given (firmware not echoing ids back):
+ * then it is only counted and warned about.
+ */
+static int xai_device_answer_match (struct xai_context *ctx,
+        struct xai_ll_message_header *req, unsigned char opcode,
+        struct xai_ll_message *answer)
+{
+    if (answer->header.operation != opcode)
+        return 0;
+
+    if (answer->header.id == req->id ||
+            (req->operation == XAI_MOUSE_LL_GET_PROFILE_SETTINGS &&
+             answer->header.id == (unsigned char)(req->id + 1)))
+        return 1;
+
+    ctx->stats.failures[XAI_FAIL_BAD_ID]++;
+    if (!ctx->any_id) {
+        XAI_PROBE3(poll__discard, opcode, req->id, answer->header.id);
+        return 0;
+    }
+
+    if (ctx->usb_debug || !ctx->id_warned)
+        fprintf(stderr, "%s: warning: answer id 0x%02X, request id 0x%02X\n",
+                XAI_MOUSE_PROGRAM_NAME, answer->header.id, req->id);
+    ctx->id_warned = 1;
+    return 1;
+}
+
+/*
+ * Wait for the answer to request 'req' (GetReport polling).
+ * Any other report (not ready yet, see xai_device_answer_match) is
+ * discarded and device is polled again, with an increasing delay, until
+ * timeout.
+ */
+static int xai_device_poll_answer (struct xai_context *ctx,
+        struct xai_ll_message_header *req, unsigned char opcode,
+        struct xai_ll_message *out)
+{
+    unsigned long long deadline = xai_time_us() + XAI_POLL_TIMEOUT_US;
+    unsigned int delay = XAI_POLL_DELAY_MIN_US;
+    int ret;
+
+    for (;;) {
+        out->header = *req; /* for transfer__start probe */
+        ret = xai_device_transfer_packet(ctx, (unsigned char *)out,
+                PACKET_READ);
+        if (ret != RET_OK)
+            return ret;
+
+        if (xai_device_answer_match(ctx, req, opcode, out))
+            return RET_OK;
+
+        if (xai_time_us() + delay > deadline)
+            break;
+
+        ctx->stats.retries++;
+        XAI_PROBE3(poll__sleep, req->operation, req->id, delay);
+        usleep(delay);
+        if (delay < XAI_POLL_DELAY_MAX_US)
+            delay *= 2;
+    }
+
+    ctx->stats.failures[XAI_FAIL_NO_PONG]++;
+    XAI_PROBE2(poll__timeout, req->operation, req->id);
+    return RET_ERROR_BUS;
+}
+
+/* For reading a message (64 bytes), we need 1 write + 1 (or more) read */
+static int xai_device_read_packet(struct xai_context *ctx,
+        struct xai_ll_message_header *in, struct xai_ll_message *out)
+{
+    int ret;
+
+    memset(out, 0, sizeof(struct xai_ll_message));
+    out->header.operation = in->operation;
+    out->header.id        = in->id;
+    out->header.part      = in->part;
+    out->header.argument1 = in->argument1;
+
+    ret = xai_device_transfer_packet(ctx, (unsigned char *)out, PACKET_WRITE);
+    if (ret == RET_OK)
+        ret = xai_device_poll_answer(ctx, in, XAI_MOUSE_LL_PONG_OR_RES, out);
+
+    return ret;
+}
+
+/* For writing a message (64 bytes), we need 1 write + 1 (or more) read */
+static int xai_device_write_packet(struct xai_context *ctx,
+        struct xai_ll_message *in)
+{
+    struct xai_ll_message_header req = in->header;
+    int ret;
+
+    ret = xai_device_transfer_packet(ctx, (unsigned char *)in, PACKET_WRITE);
+    if (ret == RET_OK)
+        ret = xai_device_poll_answer(ctx, &req, XAI_MOUSE_LL_PING_OR_ACK, in);
+
+    return ret;
+}
+
+/*
+ * Asynchronous requests, for main loop integration: nothing blocks.
+ * The caller polls file descriptors given by xai_async_pollfds, with
+ * timeout from xai_async_next_timeout, then calls xai_async_handle_events.
+ * Completion (answer or error) is reported through the callback given to
+ * xai_async_submit, from xai_async_handle_events. Several devices (one
+ * context each) can be driven by the same loop.
+ *
+ * Simulated device has no file descriptor: its transfers are done by
+ * xai_async_handle_events (next timeout is 0 while a request is pending).
+ */
+
+/*
+ * \param[in] req Request (header and data), id must be set by caller
+ * \param[in] opcode Answer expected (PONG or ACK), 0 for none (handshake)
+ */
+static int xai_async_submit (struct xai_context *ctx,
+        struct xai_ll_message *req, unsigned char opcode, xai_async_cb done,
+        void *user)
+{
+    struct xai_async *a = &ctx->async;
+
+    if (a->state != XAI_ASYNC_IDLE)
+        return RET_ERROR_BUSY;
+
+    if (!ctx->sim && a->transfer == NULL) {
+        a->transfer = libusb_alloc_transfer(0);
+        if (a->transfer == NULL)
+            return RET_ERROR_SYSTEM;
+    }
+
+    a->req = *req;
+    a->opcode = opcode;
+    a->done = done;
+    a->user = user;
+    a->state = XAI_ASYNC_SEND;
+
+    if (xai_async_transfer(ctx, PACKET_WRITE) != RET_OK) {
+        a->state = XAI_ASYNC_IDLE;
+        ctx->stats.failures[XAI_FAIL_BUS]++;
+        return RET_ERROR_BUS;
+    }
+
+    return RET_OK;
+}
+
+/*
+ * Submit SetReport (request) or GetReport (answer polling).
+ * On error, caller counts the failure (once) and ends the request.
+ */
+static int xai_async_transfer (struct xai_context *ctx, int direction)
+{
+    struct xai_async *a = &ctx->async;
+
+    a->state = (direction == PACKET_WRITE) ? XAI_ASYNC_SEND : XAI_ASYNC_POLL;
+    ctx->stats.transfers++;
+    XAI_PROBE5(transfer__start, direction, a->req.header.operation,
+            a->req.header.part, a->req.header.argument1, a->req.header.id);
+
+    if (ctx->sim)
+        return RET_OK; /* see xai_async_handle_events */
+
+    libusb_fill_control_setup(a->buffer, LIBUSB_DT_HID | direction,
+            (direction == PACKET_WRITE) ? 0x09 : 0x01, // SetReport / GetReport
+            0x0300,                                    // Feature
+            XAI_MOUSE_INTERFACE_NUM, PACKET_SIZE);
+
+    if (direction == PACKET_WRITE)
+        memcpy(a->buffer + LIBUSB_CONTROL_SETUP_SIZE, &a->req, PACKET_SIZE);
+    else
+        memset(a->buffer + LIBUSB_CONTROL_SETUP_SIZE, 0x55, PACKET_SIZE);
+
+    libusb_fill_control_transfer(a->transfer, ctx->dev, a->buffer,
+            xai_async_usb_cb, ctx, PACKET_TIMEOUT);
+
+    if (libusb_submit_transfer(a->transfer) != LIBUSB_SUCCESS)
+        return RET_ERROR_BUS;
+
+    return RET_OK;
+}
+
+static void LIBUSB_CALL xai_async_usb_cb (struct libusb_transfer *transfer)
+{
+    struct xai_context *ctx = (struct xai_context *)transfer->user_data;
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+            ctx->async.state == XAI_ASYNC_POLL)
+        memcpy(&ctx->async.answer,
+                libusb_control_transfer_get_data(transfer), PACKET_SIZE);
+
+    xai_async_complete(ctx, (transfer->status == LIBUSB_TRANSFER_COMPLETED) ?
+            RET_OK : RET_ERROR_BUS);
+}
+
+/*
+ * Transfer done: go on with answer polling (same rules as
+ * xai_device_poll_answer) or report completion.
+ */
+static void xai_async_complete (struct xai_context *ctx, int ret)
+{
+    struct xai_async *a = &ctx->async;
+    unsigned long long now;
+
+    XAI_PROBE6(transfer__end, (a->state == XAI_ASYNC_SEND) ? PACKET_WRITE :
+            PACKET_READ, a->req.header.operation, a->req.header.part,
+            a->req.header.argument1, a->req.header.id, ret);
+
+    if (ret != RET_OK) {
+        ctx->stats.failures[XAI_FAIL_BUS]++;
+    } else if (a->state == XAI_ASYNC_SEND && a->opcode != 0) {
+        a->delay = XAI_POLL_DELAY_MIN_US;
+        a->deadline = xai_time_us() + XAI_POLL_TIMEOUT_US;
+        ret = xai_async_transfer(ctx, PACKET_READ);
+        if (ret == RET_OK)
+            return;
+        ctx->stats.failures[XAI_FAIL_BUS]++;
+    } else if (a->state == XAI_ASYNC_POLL) {
+        if (xai_device_answer_match(ctx, &a->req.header, a->opcode,
+                    &a->answer))
+            goto async_done;
+
+        now = xai_time_us();
+        if (now + a->delay <= a->deadline) {
+            ctx->stats.retries++;
+            XAI_PROBE3(poll__sleep, a->req.header.operation, a->req.header.id,
+                    a->delay);
+            a->wake_at = now + a->delay;
+            if (a->delay < XAI_POLL_DELAY_MAX_US)
+                a->delay *= 2;
+            a->state = XAI_ASYNC_WAIT;
+            return;
+        }
+
+        ctx->stats.failures[XAI_FAIL_NO_PONG]++;
+        XAI_PROBE2(poll__timeout, a->req.header.operation, a->req.header.id);
+        ret = RET_ERROR_BUS;
+    }
+
+async_done:
+    a->state = XAI_ASYNC_IDLE;
+    if (a->done)
+        a->done(ctx, &a->answer, ret, a->user);
+}
+
+/*
+ * File descriptors to watch for this device.
+ * Returns number of entries filled (0 for simulated device).
+ */
+static int xai_async_pollfds (struct xai_context *ctx, struct pollfd *fds,
+        int max)
+{
+    const struct libusb_pollfd **list;
+    int i, n = 0;
+
+    if (ctx->sim)
+        return 0;
+
+    list = libusb_get_pollfds(ctx->libusb_ctx);
+    if (list == NULL)
+        return 0;
+
+    for (i = 0; list[i] != NULL && n < max; i++, n++) {
+        fds[n].fd = list[i]->fd;
+        fds[n].events = list[i]->events;
+        fds[n].revents = 0;
+    }
+
+    libusb_free_pollfds(list);
+    return n;
+}
+
+/* Milliseconds before xai_async_handle_events must be called, -1: none */
+static int xai_async_next_timeout (struct xai_context *ctx)
+{
+    struct xai_async *a = &ctx->async;
+    struct timeval tv;
+    unsigned long long now;
+    int ms = -1;
+
+    if (a->state == XAI_ASYNC_IDLE)
         return -1;
+
+    if (a->state == XAI_ASYNC_WAIT) {
+        now = xai_time_us();
+        ms = (a->wake_at > now) ? (int)((a->wake_at - now + 999) / 1000) : 0;
+    } else if (ctx->sim) {
+        ms = 0;
+    }
+
+    if (!ctx->sim && libusb_get_next_timeout(ctx->libusb_ctx, &tv) == 1) {
+        int t = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        if (ms < 0 || t < ms)
+            ms = t;
+    }
+
+    return ms;
+}
+
+/* Advance on readiness (or timeout), never blocks */
+static int xai_async_handle_events (struct xai_context *ctx)
+{
+    struct xai_async *a = &ctx->async;
+    struct timeval zero = { 0, 0 };
+    int ret = RET_OK;
+
+    if (!ctx->sim &&
+            libusb_handle_events_timeout_completed(ctx->libusb_ctx, &zero,
+                NULL) < 0)
+        return RET_ERROR_BUS;
+
+    if (a->state == XAI_ASYNC_WAIT && xai_time_us() >= a->wake_at) {
+        ret = xai_async_transfer(ctx, PACKET_READ);
+        if (ret != RET_OK)
+            xai_async_complete(ctx, ret);
+    }
+
+    if (ctx->sim && (a->state == XAI_ASYNC_SEND || a->state == XAI_ASYNC_POLL)) {
+        if (a->state == XAI_ASYNC_SEND)
+            ret = xai_sim_transfer(ctx->sim, (unsigned char *)&a->req,
+                    PACKET_WRITE);
+        else
+            ret = xai_sim_transfer(ctx->sim, (unsigned char *)&a->answer,
+                    PACKET_READ);
+        xai_async_complete(ctx, ret);
     }
 
     return RET_OK;
 }
 
-static int xai_profile_change_req (struct xai_profile *p, unsigned long field,
-        char *arg)
+/* Abort request in flight (if any), no completion is reported */
+static void xai_async_cancel (struct xai_context *ctx)
 {
-    unsigned long n;
+    struct xai_async *a = &ctx->async;
+    struct timeval tv = { 0, 100000 };
 
-    /* just to know if function were called */
-    p->fields |= PROFILE_FIELD_MASK;
+    a->done = NULL;
 
-    switch (field) {
-        case PROFILE_FIELD_BUTTON_1:
-            if (button_setup_parse((const char *)arg, &p->button[0])
-                    == RET_OK) {
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 1);
+    if (a->transfer == NULL) {
+        a->state = XAI_ASYNC_IDLE;
+        return;
+    }
+
+    if ((a->state == XAI_ASYNC_SEND || a->state == XAI_ASYNC_POLL) &&
+            libusb_cancel_transfer(a->transfer) == LIBUSB_SUCCESS) {
+        while (a->state == XAI_ASYNC_SEND || a->state == XAI_ASYNC_POLL)
+            if (libusb_handle_events_timeout_completed(ctx->libusb_ctx, &tv,
+                        NULL) < 0)
+                break;
+    }
+
+    a->state = XAI_ASYNC_IDLE;
+    libusb_free_transfer(a->transfer);
+    a->transfer = NULL;
+}
+
+/*
+ * Simulated device (--simulate). Mimics mouse answers, so soak tests can be
+ * run without hardware. Faults can be injected: for a given percentage of
+ * transfers, a read fails (bus error), is not ready yet (request echoed)
+ * or is stale (previous answer); a write can be lost (acked but ignored).
+ */
+static int xai_sim_init (int fault_rate, struct xai_context *ctx)
+{
+    static const unsigned short buttons[XAI_MOUSE_BUTTON_NUM] = {
+        9, 6, 10, 5, 4, 13, 13, 11, 12 };
+    struct xai_ll_message msg;
+    struct xai_sim *sim;
+    int i, ret;
+
+    ctx->lock_fd = -1;
+    ctx->journal_fd = -1;
+
+    sim = (struct xai_sim *)calloc(1, sizeof(struct xai_sim));
+    if (sim == NULL)
+        return RET_ERROR_SYSTEM;
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
+        memset(&msg, 0, sizeof(struct xai_ll_message));
+        memcpy(&msg.u.part1.__unknown1__[0], "\x64\x64\x64", 3);
+        memcpy(&msg.u.part1.__unknown2__[0], "\x00\x00\x03\x06\x01", 5);
+        msg.u.part1.__unknown3__ = 0x06;
+        msg.u.part1.rate = 300;
+        msg.u.part1.aim = 0x64;
+        msg.u.part1.freemove = 0x64;
+        msg.u.part1.brightness = 5;
+        msg.u.part1.contrast = 9;
+        memcpy(&sim->ram.parts[i][0][0], &msg.u.data[0], XAI_MOUSE_LL_DATA_LENGTH);
+
+        memset(&msg.u, 0, sizeof(msg.u));
+        msg.u.part2.cpi1 = 600;
+        msg.u.part2.cpi2 = 800;
+        memcpy(&sim->ram.parts[i][1][0], &msg.u.data[0], XAI_MOUSE_LL_DATA_LENGTH);
+
+        memset(&msg.u, 0, sizeof(msg.u));
+        msg.u.part3.button1 = buttons[0];
+        msg.u.part3.button2 = buttons[1];
+        msg.u.part3.button3 = buttons[2];
+        msg.u.part3.button4 = buttons[3];
+        msg.u.part3.button5 = buttons[4];
+        msg.u.part3.button6 = buttons[5];
+        msg.u.part3.button7 = buttons[6];
+        msg.u.part3.__unknown1__ = 0x07;
+        msg.u.part3.lr_handed_mode = 0x0D;
+        msg.u.part3.__unknown2__ = 0x0D;
+        msg.u.part3.__unknown3__ = 0x0D;
+        msg.u.part3.button8 = buttons[7];
+        msg.u.part3.button9 = buttons[8];
+        memcpy(&sim->ram.parts[i][2][0], &msg.u.data[0], XAI_MOUSE_LL_DATA_LENGTH);
+
+        snprintf(sim->ram.names[i], XAI_MOUSE_LL_DATA_LENGTH, "Profile %d", i + 1);
+    }
+
+    sim->flash = sim->ram;
+    sim->suspended = 1;
+    sim->fault_rate = fault_rate;
+    sim->seed = (unsigned int)(getpid() ^ xai_time_us());
+
+    ctx->sim = sim;
+    ctx->dev = NULL;
+    ctx->libusb_ctx = NULL;
+
+    /* all simulated devices share the same lock */
+    snprintf(ctx->devname, sizeof(ctx->devname), "sim");
+
+    /* as xai_power_open: opening resumes it from autosuspend */
+    xai_phase_begin(ctx);
+    usleep(XAI_SIM_WAKE_US);
+    sim->suspended = 0;
+    ctx->wake_us = XAI_SIM_WAKE_US;
+    xai_phase_end(ctx, XAI_PHASE_WAKE, 0);
+
+    if (ctx->usb_debug)
+        fprintf(stderr, "%s: device %s was suspended, wake-up took %.2f ms\n",
+                XAI_MOUSE_PROGRAM_NAME, ctx->devname, ctx->wake_us / 1000.0);
+    xai_phase_begin(ctx);
+    ret = xai_lock_acquire(ctx);
+    xai_phase_end(ctx, XAI_PHASE_LOCK, 0);
+    if (ret != RET_OK) {
+        free(sim);
+        ctx->sim = NULL;
+        return ret;
+    }
+
+    return xai_power_begin(ctx);
+}
+
+static int xai_sim_transfer (struct xai_sim *sim,
+        unsigned char packet[PACKET_SIZE], int direction)
+{
+    struct xai_ll_message *msg = (struct xai_ll_message *)packet;
+    struct xai_sim_bank *b = &sim->ram;
+    unsigned char index, part;
+    int fault;
+
+    fault = (sim->fault_rate > 0) &&
+        ((int)(rand_r(&sim->seed) % 100) < sim->fault_rate);
+
+    if (sim->suspended) {
+        usleep(XAI_SIM_WAKE_US);
+        sim->suspended = 0;
+    }
+
+    usleep(XAI_SIM_LATENCY_US);
+
+    if (direction == PACKET_READ) {
+        if (fault) {
+            switch (rand_r(&sim->seed) % 3) {
+                case 0:
+                    return RET_ERROR_BUS;
+                case 1: /* not ready yet */
+                    memcpy(packet, &sim->request, PACKET_SIZE);
+                    return RET_OK;
+                default: /* stale answer */
+                    memcpy(packet, &sim->response, PACKET_SIZE);
+                    msg->header.id--;
+                    return RET_OK;
             }
-            break;
-        case PROFILE_FIELD_BUTTON_2:
-            if (button_setup_parse((const char *)arg, &p->button[1])
-                    == RET_OK) {
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 2);
+        }
+
+        memcpy(packet, sim->pending ? &sim->response : &sim->request,
+                PACKET_SIZE);
+        return RET_OK;
+    }
+
+    memcpy(&sim->request, packet, PACKET_SIZE);
+    memcpy(&sim->response, packet, PACKET_SIZE);
+    sim->response.header.operation = XAI_MOUSE_LL_PING_OR_ACK;
+    sim->pending = 1;
+
+    index = msg->header.argument1;
+    part = msg->header.part;
+
+    switch (msg->header.operation) {
+        case XAI_MOUSE_LL_GET_PROFILE_SETTINGS:
+            if (index >= XAI_MOUSE_PROFILE_NUM || part < 1 || part > 3) {
+                sim->pending = 0;
+                break;
             }
+            sim->response.header.operation = XAI_MOUSE_LL_PONG_OR_RES;
+            memcpy(&sim->response.u.data[0], &b->parts[index][part - 1][0],
+                    XAI_MOUSE_LL_DATA_LENGTH);
             break;
-        case PROFILE_FIELD_BUTTON_3:
-            if (button_setup_parse((const char *)arg, &p->button[2])
-                    == RET_OK) {
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 3);
+
+        case XAI_MOUSE_LL_GET_PROFILE_NAME:
+            if (index >= XAI_MOUSE_PROFILE_NUM) {
+                sim->pending = 0;
+                break;
             }
+            sim->response.header.operation = XAI_MOUSE_LL_PONG_OR_RES;
+            memcpy(&sim->response.u.data[0], b->names[index],
+                    XAI_MOUSE_LL_DATA_LENGTH);
             break;
-        case PROFILE_FIELD_BUTTON_4:
-            if (button_setup_parse((const char *)arg, &p->button[3])
-                    == RET_OK) {
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 4);
-            }
+
+        case XAI_MOUSE_LL_GET_CURRENT_PROFILE:
+            sim->response.header.operation = XAI_MOUSE_LL_PONG_OR_RES;
+            sim->response.header.part = b->cur_index;
+            memset(&sim->response.u.data[0], 0, XAI_MOUSE_LL_DATA_LENGTH);
             break;
-        case PROFILE_FIELD_BUTTON_5:
-            if (button_setup_parse((const char *)arg, &p->button[4])
-                    == RET_OK) {
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 5);
-            }
+
+        case XAI_MOUSE_LL_SET_PROFILE_SETTINGS:
+            if (index < XAI_MOUSE_PROFILE_NUM && part >= 1 && part <= 3 &&
+                    !(fault && (rand_r(&sim->seed) % 4) == 0))
+                memcpy(&b->parts[index][part - 1][0], &msg->u.data[0],
+                        XAI_MOUSE_LL_DATA_LENGTH);
             break;
-        case PROFILE_FIELD_BUTTON_6:
-            if (button_setup_parse((const char *)arg, &p->button[5])
-                    == RET_OK) {
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 6);
+
+        case XAI_MOUSE_LL_SET_PROFILE_NAME:
+            if (index < XAI_MOUSE_PROFILE_NUM) {
+                memset(b->names[index], 0, XAI_MOUSE_LL_DATA_LENGTH);
+                memcpy(b->names[index], &msg->u.data[4],
+                        XAI_MOUSE_LL_DATA_LENGTH - 5);
             }
             break;
-        case PROFILE_FIELD_BUTTON_7:
-            if (button_setup_parse((const char *)arg, &p->button[6])
-                    == RET_OK) {
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 7);
-            }
+
+        case XAI_MOUSE_LL_SET_CURRENT_PROFILE:
+            if (part < XAI_MOUSE_PROFILE_NUM)
+                b->cur_index = part;
             break;
-        case PROFILE_FIELD_BUTTON_8:
-            if (button_setup_parse((const char *)arg, &p->button[7])
-                    == RET_OK) {
+
+        case XAI_MOUSE_LL_SAVE_TO_FLASH:
+            sim->flash = sim->ram;
+            sim->flash_writes++;
+            break;
+
+        default: /* handshake: no answer */
+            sim->pending = 0;
+            break;
+    }
+
+    return RET_OK;
+}
+
+static int xai_device_packet_print (FILE *out, unsigned char packet[PACKET_SIZE],
+        int host_to_device)
+{
+    int i;
+
+    if (host_to_device)
+        fputs("> ", out);
+    else
+        fputs("< ", out);
+
+    for (i = 0; i < 32; i++) {
+        fprintf(out, "%02X ", packet[i]);
+    }
+    fputs("\n", out);
+    return RET_OK;
+}
+
+/* Init sequence, must be sent before any other message */
+static int xai_device_handshake (struct xai_context *ctx)
+{
+    unsigned char packet[PACKET_SIZE];
+
+    memset(&packet[0], 0, PACKET_SIZE);
+    memcpy(&packet[0], &init_string[0], sizeof(init_string));
+
+    if (xai_device_transfer_packet(ctx, packet, PACKET_WRITE) != RET_OK)
+        return RET_ERROR_BUS;
+
+    ctx->cur_id = 0x77;
+    return RET_OK;
+}
+
+/* Read entire mouse configuration */
+static int xai_device_init (struct xai_context *ctx)
+{
+    struct xai_plan plan;
+
+    xai_plan_build(ctx, 0, NULL, &plan);
+    if (xai_plan_run(ctx, &plan) != RET_OK)
+        return RET_ERROR_BUS;
+
+    ctx->p_valid = 1;
+    return RET_OK;
+}
+
+/*
+ * Quick status query: handshake and current profile index (and optionally
+ * its name) only. No full configuration read.
+ */
+static int xai_device_status (struct xai_context *ctx, int with_name)
+{
+    int index = XAI_MOUSE_PROFILE_NUM; // out of bound index
+    int ret;
+
+    xai_phase_begin(ctx);
+    ret = xai_device_handshake(ctx);
+    xai_phase_end(ctx, XAI_PHASE_HANDSHAKE, 0);
+    if (ret != RET_OK)
+        return ret;
+
+    xai_phase_begin(ctx);
+    ret = xai_profile_get_current_index(ctx, &index);
+    xai_phase_end(ctx, XAI_PHASE_CONFIGS, 0);
+    if (ret != RET_OK)
+        return ret;
+
+    if (index < 0 || index >= XAI_MOUSE_PROFILE_NUM)
+        return RET_ERROR_BUS;
+
+    ctx->cur_index = (unsigned char)index;
+
+    if (with_name) {
+        xai_phase_begin(ctx);
+        ret = xai_profile_get_name(ctx, index, &ctx->p[index]);
+        xai_phase_end(ctx, XAI_PHASE_NAMES, 0);
+    }
+
+    return ret;
+}
+
+/* Compact output: "2" or "2 Profile name" (1-based profile number) */
+static int xai_device_status_print (FILE *out, struct xai_context *ctx,
+        int with_name)
+{
+    if (with_name)
+        fprintf(out, "%d %s\n", ctx->cur_index + 1, ctx->p[ctx->cur_index].name);
+    else
+        fprintf(out, "%d\n", ctx->cur_index + 1);
+    return RET_OK;
+}
+
+/*
+ * Send prepared messages (SET_xxx), in order.
+ * If a journal is opened (see xai_journal_begin), each acknowledged
+ * message is marked as done.
+ */
+static int xai_device_send (struct xai_context *ctx,
+        struct xai_ll_message *msgs, int count)
+{
+    struct xai_ll_message msg;
+    int i, ret = RET_OK;
+
+    for (i = 0; i < count; i++) {
+        msg = msgs[i];
+        msg.header.id = xai_device_next_id(ctx);
+
+        if (ctx->usb_debug)
+            xai_device_packet_print(stderr, (unsigned char *)&msg, 1);
+
+        XAI_PROBE4(profile__set__start, msgs[i].header.operation,
+                msgs[i].header.part, msgs[i].header.argument1, msg.header.id);
+        ret = xai_device_write_packet(ctx, &msg);
+        XAI_PROBE5(profile__set__end, msgs[i].header.operation,
+                msgs[i].header.part, msgs[i].header.argument1,
+                msg.header.id, ret);
+
+        if (ctx->usb_debug)
+            xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+
+        if (ret != RET_OK)
+            break;
+
+        if (msgs[i].header.operation == XAI_MOUSE_LL_SET_PROFILE_SETTINGS) {
+            xai_profile_cache_part(ctx, msgs[i].header.argument1,
+                    msgs[i].header.part, &msgs[i]);
+            if (ctx->p_valid &&
+                    msgs[i].header.argument1 < XAI_MOUSE_PROFILE_NUM)
+                xai_profile_decode_part(&ctx->p[msgs[i].header.argument1],
+                        msgs[i].header.part, &msgs[i]);
+        }
+
+        if (msgs[i].header.operation == XAI_MOUSE_LL_SET_PROFILE_NAME &&
+                ctx->p_valid &&
+                msgs[i].header.argument1 < XAI_MOUSE_PROFILE_NUM) {
+            memset(ctx->p[msgs[i].header.argument1].name, 0,
+                    XAI_MOUSE_LL_DATA_LENGTH);
+            strncpy(ctx->p[msgs[i].header.argument1].name,
+                    &msgs[i].u.data[4], XAI_MOUSE_LL_DATA_LENGTH - 5);
+        }
+
+        if (ctx->journal_fd >= 0)
+            xai_journal_done(ctx, ctx->journal_base + i);
+    }
+
+    return ret;
+}
+
+/*
+ * Save all settings to flash (current profile index, ...)
+ */
+static int xai_device_write_to_flash (struct xai_context *ctx)
+{
+    struct xai_ll_message msg;
+    int ret;
+
+    memset(&msg, 0, sizeof(struct xai_ll_message));
+
+    msg.header.operation = XAI_MOUSE_LL_SAVE_TO_FLASH;
+    msg.header.id = xai_device_next_id(ctx);
+    XAI_PROBE2(flash__start, msg.header.operation, msg.header.id);
+    ret = xai_device_write_packet(ctx, &msg);
+    XAI_PROBE3(flash__end, msg.header.operation, msg.header.id, ret);
+
+    if (ctx->usb_debug)
+        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+
+    return ret;
+}
+
+/*
+ * Write-ahead journal. Before a multi-message change is sent, all
+ * prepared messages are stored on disk (one file per device); each one is
+ * marked as done once acknowledged. If the program dies (or device is
+ * unplugged) in the middle, next run only sends the remaining messages
+ * and commits to flash.
+ *
+ * Journal is private: XAI_JOURNAL_DIR for root, $XDG_RUNTIME_DIR/xaictl
+ * for other users, directory and file owned by current user and not
+ * writable by others (a planted journal would be sent to the mouse).
+ */
+static int xai_journal_path (struct xai_context *ctx, char *path, size_t len)
+{
+    const char *run = getenv("XDG_RUNTIME_DIR");
+    struct stat st;
+    int n;
+
+    if (geteuid() == 0)
+        n = snprintf(path, len, "%s", XAI_JOURNAL_DIR);
+    else if (run != NULL && run[0] == '/')
+        n = snprintf(path, len, "%s/%s", run, XAI_MOUSE_PROGRAM_NAME);
+    else
+        return RET_ERROR_SYSTEM;
+
+    if (n >= (int)len)
+        return RET_ERROR_SYSTEM;
+
+    mkdir(path, 0700);
+    if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode) ||
+            st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+        return RET_ERROR_SYSTEM;
+
+    if (snprintf(path + n, len - n, "/%s-%s.journal", XAI_MOUSE_PROGRAM_NAME,
+                ctx->devname) >= (int)(len - n))
+        return RET_ERROR_SYSTEM;
+
+    return RET_OK;
+}
+
+/* Only these requests are replayed from a journal */
+static int xai_journal_opcode_valid (unsigned char opcode)
+{
+    return opcode == XAI_MOUSE_LL_SET_PROFILE_SETTINGS ||
+        opcode == XAI_MOUSE_LL_SET_PROFILE_NAME ||
+        opcode == XAI_MOUSE_LL_SET_CURRENT_PROFILE;
+}
+
+static int xai_journal_begin (struct xai_context *ctx,
+        struct xai_ll_message *msgs, int count, int flash)
+{
+    struct xai_journal_header h;
+    struct xai_journal_entry e;
+    char path[256], tmp[264];
+    int i, fd, err = 0;
+
+    ctx->journal_fd = -1;
+    ctx->journal_base = 0;
+
+    if (xai_journal_path(ctx, path, sizeof(path)) != RET_OK) {
+        fprintf(stderr, "%s: no private journal directory, changes are not "
+                "journaled\n", XAI_MOUSE_PROGRAM_NAME);
+        return RET_ERROR_SYSTEM;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    unlink(tmp);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+            0600);
+    if (fd < 0) {
+        fprintf(stderr, "%s: can't create %s, changes are not journaled\n",
+                XAI_MOUSE_PROGRAM_NAME, tmp);
+        return RET_ERROR_SYSTEM;
+    }
+
+    memset(&h, 0, sizeof(struct xai_journal_header));
+    h.magic = XAI_JOURNAL_MAGIC;
+    h.count = count;
+    h.flash = flash;
+    err = (write(fd, &h, sizeof(h)) != sizeof(h));
+
+    for (i = 0; i < count && !err; i++) {
+        e.msg = msgs[i];
+        e.done = 0;
+        err = (write(fd, &e, sizeof(e)) != sizeof(e));
+    }
+
+    if (err || fsync(fd) < 0 || rename(tmp, path) < 0) {
+        close(fd);
+        unlink(tmp);
+        fprintf(stderr, "%s: can't write %s, changes are not journaled\n",
+                XAI_MOUSE_PROGRAM_NAME, path);
+        return RET_ERROR_SYSTEM;
+    }
+
+    close(fd);
+    ctx->journal_fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    return RET_OK;
+}
+
+/* Mark a message as acknowledged by device */
+static void xai_journal_done (struct xai_context *ctx, int i)
+{
+    static const unsigned char done = 1;
+    off_t pos = sizeof(struct xai_journal_header) +
+        i * sizeof(struct xai_journal_entry) +
+        offsetof(struct xai_journal_entry, done);
+
+    if (pwrite(ctx->journal_fd, &done, 1, pos) == 1)
+        fdatasync(ctx->journal_fd);
+}
+
+/* Everything has been sent (and committed): discard journal */
+static void xai_journal_end (struct xai_context *ctx)
+{
+    char path[256];
+
+    if (ctx->journal_fd < 0)
+        return;
+
+    close(ctx->journal_fd);
+    ctx->journal_fd = -1;
+
+    if (xai_journal_path(ctx, path, sizeof(path)) == RET_OK)
+        unlink(path);
+}
+
+/*
+ * Replay unfinished messages of an interrupted run (if any)
+ */
+static int xai_journal_recover (struct xai_context *ctx)
+{
+    struct xai_journal_header h;
+    struct xai_journal_entry e[XAI_JOURNAL_MAX];
+    struct xai_ll_message msg;
+    struct stat st;
+    char path[256];
+    int i, fd, pending = 0, ret;
+
+    ctx->journal_fd = -1;
+    if (xai_journal_path(ctx, path, sizeof(path)) != RET_OK)
+        return RET_OK;
+
+    fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return RET_OK;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+            st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        fprintf(stderr, "%s: ignoring untrusted journal %s\n",
+                XAI_MOUSE_PROGRAM_NAME, path);
+        close(fd);
+        return RET_OK;
+    }
+
+    if (read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != XAI_JOURNAL_MAGIC ||
+            h.count > XAI_JOURNAL_MAX ||
+            read(fd, e, h.count * sizeof(struct xai_journal_entry)) !=
+            (ssize_t)(h.count * sizeof(struct xai_journal_entry)))
+        h.count = XAI_JOURNAL_MAX + 1;
+
+    for (i = 0; i < (int)h.count && h.count <= XAI_JOURNAL_MAX; i++)
+        if (!xai_journal_opcode_valid(e[i].msg.header.operation))
+            h.count = XAI_JOURNAL_MAX + 1;
+
+    if (h.count > XAI_JOURNAL_MAX) {
+        fprintf(stderr, "%s: ignoring corrupted journal %s\n",
+                XAI_MOUSE_PROGRAM_NAME, path);
+        close(fd);
+        unlink(path);
+        return RET_OK;
+    }
+
+    for (i = 0; i < (int)h.count; i++)
+        if (!e[i].done)
+            pending++;
+
+    fprintf(stderr, "%s: resuming interrupted changes on %s (%d of %d "
+            "message(s) pending)\n", XAI_MOUSE_PROGRAM_NAME, ctx->devname,
+            pending, h.count);
+
+    if ((ret = xai_device_handshake(ctx)) != RET_OK) {
+        close(fd);
+        return ret;
+    }
+
+    ctx->journal_fd = fd;
+
+    for (i = 0; i < (int)h.count; i++) {
+        if (e[i].done)
+            continue;
+
+        msg = e[i].msg;
+        ctx->journal_base = i;
+        if ((ret = xai_device_send(ctx, &msg, 1)) != RET_OK)
+            goto journal_recover_err;
+    }
+
+    if (h.flash && (ret = xai_device_write_to_flash(ctx)) != RET_OK)
+        goto journal_recover_err;
+
+    xai_journal_end(ctx);
+    return RET_OK;
+
+journal_recover_err:
+    close(fd);
+    ctx->journal_fd = -1;
+    return ret;
+}
+
+
+/*
+ * Fill xai_profile structure : configuration settings
+ * \param[in] index 0-based profile number
+ */
+static int xai_profile_get_config (struct xai_context *ctx, int index,
+        struct xai_profile *profile)
+{
+    struct xai_ll_message msg;
+    int part, ret = RET_OK;
+
+    for (part = 1; part <= 3 && ret == RET_OK; part++) {
+        ret = xai_profile_read_part(ctx, index, part, &msg);
+        if (ret == RET_OK)
+            xai_profile_decode_part(profile, part, &msg);
+    }
+
+    return ret;
+}
+
+/*
+ * Read one settings part (and keep its raw content, see
+ * xai_profile_cache_part).
+ * \param[in] index 0-based profile number
+ * \param[in] part 1, 2 or 3
+ */
+static int xai_profile_read_part (struct xai_context *ctx, int index,
+        int part, struct xai_ll_message *msg)
+{
+    struct xai_ll_message_header hdr;
+    int ret;
+
+    hdr.null_byte = 0;
+    hdr.operation = XAI_MOUSE_LL_GET_PROFILE_SETTINGS;
+    hdr.id = xai_device_next_id(ctx);
+    hdr.part = (unsigned char)part;
+    hdr.argument1 = (unsigned char)index;
+    hdr.argument2 = 0;
+    XAI_PROBE4(profile__get__start, hdr.operation, part, index, hdr.id);
+    ret = xai_device_read_packet(ctx, &hdr, msg);
+    XAI_PROBE5(profile__get__end, hdr.operation, part, index, hdr.id, ret);
+
+    if (ctx->usb_debug)
+        xai_device_packet_print(stderr, (unsigned char *)msg, 0);
+
+    if (ret == RET_OK)
+        xai_profile_cache_part(ctx, index, part, msg);
+
+    return ret;
+}
+
+/*
+ * Fill profile fields from a settings part message.
+ * \param[in] part 1, 2 or 3
+ */
+static void xai_profile_decode_part (struct xai_profile *profile, int part,
+        struct xai_ll_message *msg)
+{
+    if (part == 1) {
+        profile->rate = msg->u.part1.rate;
+        profile->aim = msg->u.part1.aim;
+        profile->accel = msg->u.part1.accel;
+        profile->freemove = msg->u.part1.freemove;
+        profile->lcd_brightness = msg->u.part1.brightness;
+        profile->lcd_contrast = msg->u.part1.contrast;
+
+    } else if (part == 2) {
+        profile->cpi[0] = msg->u.part2.cpi1;
+        profile->cpi[1] = msg->u.part2.cpi2;
+
+    } else if (part == 3) {
+        profile->button[0] = msg->u.part3.button1;
+        profile->button[1] = msg->u.part3.button2;
+        profile->button[2] = msg->u.part3.button3;
+        profile->button[3] = msg->u.part3.button4;
+        profile->button[4] = msg->u.part3.button5;
+        profile->button[5] = msg->u.part3.button6;
+        profile->button[6] = msg->u.part3.button7;
+        profile->button[7] = msg->u.part3.button8;
+        profile->button[8] = msg->u.part3.button9;
+    }
+}
+
+/*
+ * Remember raw content of a settings part (as read from or acknowledged
+ * by device), unknown bytes included. Later writes of this part are
+ * composed from it without reading the device again.
+ * \param[in] part 1, 2 or 3
+ */
+static void xai_profile_cache_part (struct xai_context *ctx, int index,
+        int part, struct xai_ll_message *msg)
+{
+    if (index < 0 || index >= XAI_MOUSE_PROFILE_NUM || part < 1 || part > 3)
+        return;
+
+    memcpy(ctx->raw[index][part - 1], msg->u.data, XAI_MOUSE_LL_DATA_LENGTH);
+    ctx->raw_valid[index] |= 1 << (part - 1);
+}
+
+/*
+ * Patch a settings part message with requested fields of profile.
+ * \param[in] part 1, 2 or 3
+ * Returns 1 if at least one field has been modified.
+ */
+static int xai_profile_patch_part (struct xai_profile *profile, int part,
+        struct xai_ll_message *msg)
+{
+    int touch_flag = 0;
+
+    if (part == 1) {
+        if ((profile->fields & PROFILE_FIELD_RATE) == PROFILE_FIELD_RATE) {
+            msg->u.part1.rate = profile->rate;
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_AIM) == PROFILE_FIELD_AIM) {
+            msg->u.part1.aim = profile->aim;
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_ACCEL) == PROFILE_FIELD_ACCEL) {
+            msg->u.part1.accel = profile->accel;
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_FREEMOVE) ==
+                PROFILE_FIELD_FREEMOVE) {
+            msg->u.part1.freemove = profile->freemove;
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_LCD_BRIGHTNESS) ==
+                PROFILE_FIELD_LCD_BRIGHTNESS) {
+            msg->u.part1.brightness = profile->lcd_brightness;
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_LCD_CONTRAST) ==
+                PROFILE_FIELD_LCD_CONTRAST) {
+            msg->u.part1.contrast = profile->lcd_contrast;
+            touch_flag = 1;
+        }
+
+    } else if (part == 2) {
+        if ((profile->fields & PROFILE_FIELD_CPI1) == PROFILE_FIELD_CPI1) {
+            msg->u.part2.cpi1 = profile->cpi[0];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_CPI2) == PROFILE_FIELD_CPI2) {
+            msg->u.part2.cpi2 = profile->cpi[1];
+            touch_flag = 1;
+        }
+
+    } else if (part == 3) {
+        if ((profile->fields & PROFILE_FIELD_BUTTON_1) == PROFILE_FIELD_BUTTON_1) {
+            msg->u.part3.button1 = profile->button[0];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_BUTTON_2) == PROFILE_FIELD_BUTTON_2) {
+            msg->u.part3.button2 = profile->button[1];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_BUTTON_3) == PROFILE_FIELD_BUTTON_3) {
+            msg->u.part3.button3 = profile->button[2];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_BUTTON_4) == PROFILE_FIELD_BUTTON_4) {
+            msg->u.part3.button4 = profile->button[3];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_BUTTON_5) == PROFILE_FIELD_BUTTON_5) {
+            msg->u.part3.button5 = profile->button[4];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_BUTTON_6) == PROFILE_FIELD_BUTTON_6) {
+            msg->u.part3.button6 = profile->button[5];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_BUTTON_7) == PROFILE_FIELD_BUTTON_7) {
+            msg->u.part3.button7 = profile->button[6];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_BUTTON_8) == PROFILE_FIELD_BUTTON_8) {
+            msg->u.part3.button8 = profile->button[7];
+            touch_flag = 1;
+        }
+        if ((profile->fields & PROFILE_FIELD_BUTTON_9) == PROFILE_FIELD_BUTTON_9) {
+            msg->u.part3.button9 = profile->button[8];
+            touch_flag = 1;
+        }
+    }
+
+    return touch_flag;
+}
+
+/*
+ * Build a SET_PROFILE_SETTINGS message according to xai_profile structure.
+ * The part is composed from its cached raw content when known (blind
+ * write), otherwise it is read from device first (read-modify-write).
+ * \param[in] index 0-based profile number
+ * \param[in] part 1, 2 or 3
+ */
+static int xai_profile_compose_part (struct xai_context *ctx, int index,
+        int part, struct xai_profile *profile, struct xai_ll_message *msg)
+{
+    int ret;
+
+    if (ctx->raw_valid[index] & (1 << (part - 1))) {
+        memset(msg, 0, sizeof(struct xai_ll_message));
+        memcpy(msg->u.data, ctx->raw[index][part - 1],
+                XAI_MOUSE_LL_DATA_LENGTH);
+        msg->header.part = (unsigned char)part;
+        msg->header.argument1 = (unsigned char)index;
+    } else {
+        ret = xai_profile_read_part(ctx, index, part, msg);
+        if (ret != RET_OK)
+            return ret;
+    }
+
+    xai_profile_patch_part(profile, part, msg);
+    msg->header.operation = XAI_MOUSE_LL_SET_PROFILE_SETTINGS;
+    return RET_OK;
+}
+
+/*
+ * Build SET_PROFILE_SETTINGS messages according to xai_profile structure.
+ * Parts with no requested field are skipped.
+ * \param[in] index 0-based profile number
+ * \param[out] out Messages to send, appended at out[*count]
+ */
+static int xai_profile_compose_config (struct xai_context *ctx, int index,
+        struct xai_profile *profile, struct xai_ll_message *out, int *count)
+{
+    struct xai_ll_message msg;
+    int part, ret;
+
+    for (part = 1; part <= 3; part++) {
+        memset(&msg, 0, sizeof(struct xai_ll_message));
+        if (!xai_profile_patch_part(profile, part, &msg))
+            continue;
+
+        ret = xai_profile_compose_part(ctx, index, part, profile,
+                &out[*count]);
+        if (ret != RET_OK)
+            return ret;
+        (*count)++;
+    }
+
+    return RET_OK;
+}
+
+/*
+ * Modify profile configuration according to xai_profile structure
+ * \param[in] index 0-based profile number
+ */
+static int xai_profile_set_config (struct xai_context *ctx, int index,
+        struct xai_profile *profile)
+{
+    struct xai_ll_message msgs[3];
+    int count = 0, ret;
+
+    ret = xai_profile_compose_config(ctx, index, profile, msgs, &count);
+    if (ret == RET_OK)
+        ret = xai_device_send(ctx, msgs, count);
+
+    return ret;
+}
+
+/*
+ * Get profile name
+ * \param[in] index 0-based profile number
+ * \param[out] profile Will fill profile->name
+ */
+static int xai_profile_get_name (struct xai_context *ctx, int index,
+        struct xai_profile *profile)
+{
+    struct xai_ll_message msg;
+    struct xai_ll_message_header hdr;
+    int ret;
+
+    hdr.null_byte = 0;
+    hdr.operation = XAI_MOUSE_LL_GET_PROFILE_NAME;
+    hdr.id = xai_device_next_id(ctx);
+    hdr.part = 0;
+    hdr.argument1 = (unsigned char)index;
+    hdr.argument2 = 0;
+    XAI_PROBE4(profile__get__start, hdr.operation, 0, index, hdr.id);
+    ret = xai_device_read_packet(ctx, &hdr, &msg);
+    XAI_PROBE5(profile__get__end, hdr.operation, 0, index, hdr.id, ret);
+
+    if (ctx->usb_debug)
+        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+
+    if (ret == RET_OK) {
+        if (msg.u.data[0] == '\0')
+            profile->name[0] = 0;
+        else
+            strncpy(profile->name, &msg.u.data[0],
+                    XAI_MOUSE_LL_DATA_LENGTH);
+    }
+    return ret;
+}
+
+/*
+ * Build SET_PROFILE_NAME message
+ * \param[in] index 0-based profile number
+ * \param[in] profile New profile name is profile->name
+ */
+static void xai_profile_compose_name (struct xai_context *ctx, int index,
+        struct xai_profile *profile, struct xai_ll_message *msg)
+{
+    memset(msg, 0, sizeof(struct xai_ll_message));
+
+    msg->header.operation = XAI_MOUSE_LL_SET_PROFILE_NAME;
+    msg->header.argument1 = (unsigned char)index;
+    snprintf(&msg->u.data[4], XAI_MOUSE_LL_DATA_LENGTH - 4, "%.*s",
+            (int)(XAI_MOUSE_LL_DATA_LENGTH - 5), profile->name);
+}
+
+/*
+ * Get current used profile
+ * \param[in] index 0-based profile number
+ */
+static int xai_profile_get_current_index (struct xai_context *ctx, int *index)
+{
+    struct xai_ll_message msg;
+    struct xai_ll_message_header hdr;
+    int ret;
+
+    hdr.null_byte = 0;
+    hdr.operation = XAI_MOUSE_LL_GET_CURRENT_PROFILE;
+    hdr.id = xai_device_next_id(ctx);
+    hdr.part = 0;
+    hdr.argument1 = 0;
+    hdr.argument2 = 0;
+    XAI_PROBE4(profile__get__start, hdr.operation, 0, 0, hdr.id);
+    ret = xai_device_read_packet(ctx, &hdr, &msg);
+    XAI_PROBE5(profile__get__end, hdr.operation, 0, 0, hdr.id, ret);
+
+    if (ctx->usb_debug)
+        xai_device_packet_print(stderr, (unsigned char *)&msg, 0);
+
+    if (ret == RET_OK) {
+        *index = msg.header.part;
+    }
+    return ret;
+}
+
+/*
+ * Build SET_CURRENT_PROFILE message
+ * \param[in] index 0-based profile number
+ */
+static void xai_profile_compose_current_index (struct xai_context *ctx,
+        int index, struct xai_ll_message *msg)
+{
+    memset(msg, 0, sizeof(struct xai_ll_message));
+
+    msg->header.operation = XAI_MOUSE_LL_SET_CURRENT_PROFILE;
+    msg->header.part = (unsigned char)index;
+}
+
+/*
+ * Set current used profile
+ * \param[in] index 0-based profile number
+ */
+static int xai_profile_set_current_index (struct xai_context *ctx, int index)
+{
+    struct xai_ll_message msg;
+
+    xai_profile_compose_current_index(ctx, index, &msg);
+    return xai_device_send(ctx, &msg, 1);
+}
+
+static int xai_profile_print (FILE *out, struct xai_profile *p, int cur_flag)
+{
+    int i, len;
+
+    len = fprintf(out, "%s", p->name);
+
+    if (cur_flag)
+        fputs(" (current)\n", out);
+    else
+        fputc('\n', out);
+
+    for (i = 0; i < len; i++)
+        fputc('-', out);
+
+    fprintf(out, "\nCPI1 (led off)  : %d\n"
+            "CPI2 (led on)   : %d\n"
+            "ExactRate (Hz)  : %d\n"
+            "ExactAccel (%%)  : %d\n"
+            "ExactAim  (unit): %d (0x%x)\n"
+            "Free mode (unit): %d (0x%x)\n"
+            "LCD brightness  : %d\n"
+            "LCD contrast    : %d\n\n",
+            p->cpi[0], p->cpi[1], p->rate, p->accel,
+            (p->aim - 0x64)/5, p->aim,
+            (p->freemove - 0x64)/5, p->freemove,
+            p->lcd_brightness, p->lcd_contrast);
+
+    for (i = 0; i < XAI_MOUSE_BUTTON_NUM; i++) {
+        if (p->button[i] < (sizeof(button_setup)/sizeof(char *)))
+            fprintf(out, "Button %d : %s\n", i+1, button_setup[p->button[i]]);
+        else
+            fprintf(out, "Button %d : 0x%x\n", i+1, p->button[i]);
+    }
+
+    fputs("\n", out);
+    return RET_OK;
+}
+
+
+/* value match the index in 'button_setup' array */
+static int button_setup_parse(const char *user_input, unsigned short *value)
+{
+    if (strcasecmp(user_input, "disable") == 0 ||
+            (*user_input == 'd' && *(user_input+1) == '\0')) {
+        *value = 13;
+    } else if (strcasecmp(user_input, "left") == 0 ||
+            (*user_input == 'l' && *(user_input+1) == '\0')) {
+        *value = 9;
+    } else if (strcasecmp(user_input, "right") == 0 ||
+            (*user_input == 'r' && *(user_input+1) == '\0')) {
+        *value = 10;
+    } else if (strcasecmp(user_input, "middle") == 0 ||
+            (*user_input == 'm' && *(user_input+1) == '\0')) {
+        *value = 6;
+    } else if (strcasecmp(user_input, "wheelup") == 0 ||
+            (*user_input == 'u' && *(user_input+1) == 'p' &&
+             *(user_input+2) == '\0')) {
+        *value = 11;
+    } else if (strcasecmp(user_input, "wheeldown") == 0 ||
+            (*user_input == 'd' && *(user_input+1) == 'w' &&
+             *(user_input+2) == '\0')) {
+        *value = 12;
+    } else if (strcasecmp(user_input, "tiltleft") == 0 ||
+            (*user_input == 't' && *(user_input+1) == 'l' &&
+             *(user_input+2) == '\0')) {
+        *value = 2;
+    } else if (strcasecmp(user_input, "tiltright") == 0 ||
+            (*user_input == 't' && *(user_input+1) == 'r' &&
+             *(user_input+2) == '\0')) {
+        *value = 3;
+    } else if (strcasecmp(user_input, "ieforward") == 0 ||
+            (*user_input == 'f' && *(user_input+1) == 'w' &&
+             *(user_input+2) == '\0')) {
+        *value = 4;
+    } else if (strcasecmp(user_input, "iebackward") == 0 ||
+            (*user_input == 'b' && *(user_input+1) == 'w' &&
+             *(user_input+2) == '\0')) {
+        *value = 5;
+    } else {
+        return -1;
+    }
+
+    return RET_OK;
+}
+
+static int xai_profile_change_req (struct xai_profile *p, unsigned long field,
+        char *arg)
+{
+    unsigned long n;
+
+    /* just to know if function were called */
+    p->fields |= PROFILE_FIELD_MASK;
+
+    switch (field) {
+        case PROFILE_FIELD_BUTTON_1:
+            if (button_setup_parse((const char *)arg, &p->button[0])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 1);
+            }
+            break;
+        case PROFILE_FIELD_BUTTON_2:
+            if (button_setup_parse((const char *)arg, &p->button[1])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 2);
+            }
+            break;
+        case PROFILE_FIELD_BUTTON_3:
+            if (button_setup_parse((const char *)arg, &p->button[2])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 3);
+            }
+            break;
+        case PROFILE_FIELD_BUTTON_4:
+            if (button_setup_parse((const char *)arg, &p->button[3])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 4);
+            }
+            break;
+        case PROFILE_FIELD_BUTTON_5:
+            if (button_setup_parse((const char *)arg, &p->button[4])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 5);
+            }
+            break;
+        case PROFILE_FIELD_BUTTON_6:
+            if (button_setup_parse((const char *)arg, &p->button[5])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 6);
+            }
+            break;
+        case PROFILE_FIELD_BUTTON_7:
+            if (button_setup_parse((const char *)arg, &p->button[6])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 7);
+            }
+            break;
+        case PROFILE_FIELD_BUTTON_8:
+            if (button_setup_parse((const char *)arg, &p->button[7])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 8);
+            }
+            break;
+        case PROFILE_FIELD_BUTTON_9:
+            if (button_setup_parse((const char *)arg, &p->button[8])
+                    == RET_OK) {
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, 9);
+            }
+            break;
+
+        case PROFILE_FIELD_CPI1:
+            n = strtoul(arg, NULL, 10);
+            if (n >= XAI_MOUSE_CPI_MIN && n <= XAI_MOUSE_CPI_MAX) {
+                p->cpi[0] = (unsigned short)n;
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, "cpi1");
+            }
+            break;
+
+        case PROFILE_FIELD_CPI2:
+            n = strtoul(arg, NULL, 10);
+            if (n >= XAI_MOUSE_CPI_MIN && n <= XAI_MOUSE_CPI_MAX) {
+                p->cpi[1] = (unsigned short)n;
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, "cpi2");
+            }
+            break;
+
+        case PROFILE_FIELD_RATE:
+            n = strtoul(arg, NULL, 10);
+            if (n >= XAI_MOUSE_RATE_MIN && n <= XAI_MOUSE_RATE_MAX) {
+                p->rate = (short)n;
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, "rate");
+            }
+            break;
+
+        case PROFILE_FIELD_ACCEL:
+            n = strtoul(arg, NULL, 10);
+            if (n >= XAI_MOUSE_ACCEL_MIN && n <= XAI_MOUSE_ACCEL_MAX) {
+                p->accel = (short)n;
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, "accel");
+            }
+            break;
+
+        case PROFILE_FIELD_FREEMOVE:
+            n = strtoul(arg, NULL, 10);
+            if (n >= XAI_MOUSE_FREEMOVE_MIN && n <= XAI_MOUSE_FREEMOVE_MAX) {
+                p->freemove = (short)(0x64 + n * 5);
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, "freemove");
+            }
+            break;
+
+        case PROFILE_FIELD_AIM:
+            n = strtoul(arg, NULL, 10);
+            if (n >= XAI_MOUSE_AIM_MIN && n <= XAI_MOUSE_AIM_MAX) {
+                p->aim = (short)(0x64 + n * 5);
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, "aim");
+            }
+            break;
+
+        case PROFILE_FIELD_LCD_BRIGHTNESS:
+            n = strtoul(arg, NULL, 10);
+            if (n >= XAI_MOUSE_LCD_BRIGHTNESS_MIN &&
+                    n <= XAI_MOUSE_LCD_BRIGHTNESS_MAX) {
+                p->lcd_brightness = (short)n;
+                p->fields |= field;
+            } else {
+                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, "LCD brightness");
+            }
+            break;
+
+        case PROFILE_FIELD_LCD_CONTRAST:
+            n = strtoul(arg, NULL, 10);
+
+            if (n >= XAI_MOUSE_LCD_CONTRAST_MIN && n <=
+                    XAI_MOUSE_LCD_CONTRAST_MAX) {
+                p->lcd_contrast = (short)n;
                 p->fields |= field;
             } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 8);
+                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
+                        XAI_MOUSE_PROGRAM_NAME, "LCD contrast");
+            }
+            break;
+
+        case PROFILE_FIELD_NAME:
+            strncpy(&p->name[0], arg, XAI_MOUSE_LL_DATA_LENGTH);
+            p->fields |= field;
+            break;
+
+        default:
+            return RET_ERROR_WRONG_PARAMETER;
+    }
+
+    return RET_OK;
+}
+
+/*
+ * Parse a "key=value" change request (key is a long option name: c1,
+ * rate, b3, ...). Leading/trailing blanks are ignored.
+ */
+static int xai_profile_change_line (struct xai_profile *p, char *line)
+{
+    char *value, *end;
+    int i;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    end = line + strlen(line);
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t' ||
+                end[-1] == '\r' || end[-1] == '\n'))
+        *--end = '\0';
+
+    if ((value = strchr(line, '=')) == NULL)
+        return RET_ERROR_WRONG_PARAMETER;
+
+    for (end = value; end > line && (end[-1] == ' ' || end[-1] == '\t'); )
+        end--;
+    *end = '\0';
+    for (value++; *value == ' ' || *value == '\t'; )
+        value++;
+
+    for (i = 0; field_names[i].name != NULL; i++) {
+        if (strcmp(line, field_names[i].name) == 0)
+            return xai_profile_change_req(p, field_names[i].field, value);
+    }
+
+    return RET_ERROR_WRONG_PARAMETER;
+}
+
+
+/*
+ * Parse profile list argument: "2", "1,3-5" or "all" (1-based numbers).
+ * \param[out] targets Bit n set for 0-based profile index n
+ */
+static int xai_profile_list_parse (const char *arg, unsigned int *targets)
+{
+    const char *p = arg;
+    char *end;
+    long first, last;
+
+    *targets = 0;
+
+    if (strcasecmp(arg, "all") == 0) {
+        *targets = (1 << XAI_MOUSE_PROFILE_NUM) - 1;
+        return RET_OK;
+    }
+
+    do {
+        first = strtol(p, &end, 10);
+        last = first;
+        if (end == p)
+            return RET_ERROR_WRONG_PARAMETER;
+
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return RET_ERROR_WRONG_PARAMETER;
+        }
+
+        if (first <= 0 || last > XAI_MOUSE_PROFILE_NUM || first > last)
+            return RET_ERROR_WRONG_PARAMETER;
+
+        for (; first <= last; first++)
+            *targets |= 1 << (first - 1);
+
+        p = end + 1;
+    } while (*end == ',');
+
+    return (*end == '\0') ? RET_OK : RET_ERROR_WRONG_PARAMETER;
+}
+
+/*
+ * Apply a change set to one or several profiles and commit it to flash
+ * (once). All messages are prepared first and journaled, then sent.
+ * \param[in] targets Bit n set for 0-based profile index n
+ */
+static int xai_profile_apply (struct xai_context *ctx, unsigned int targets,
+        struct xai_profile *newp)
+{
+    struct xai_plan plan;
+
+    xai_plan_build(ctx, targets, newp, &plan);
+    return xai_plan_run(ctx, &plan);
+}
+
+/*
+ * Read back a profile and check that every requested field has been taken
+ * into account by the device.
+ * \param[in] index 0-based profile number
+ */
+static int xai_profile_verify (struct xai_context *ctx, int index,
+        struct xai_profile *newp)
+{
+    struct xai_profile p;
+    unsigned long f = newp->fields;
+    int i, cur;
+
+    memset(&p, 0, sizeof(struct xai_profile));
+
+    if (xai_profile_get_config(ctx, index, &p) != RET_OK)
+        return RET_ERROR_BUS;
+
+    if ((f & PROFILE_FIELD_NAME) == PROFILE_FIELD_NAME) {
+        if (xai_profile_get_name(ctx, index, &p) != RET_OK)
+            return RET_ERROR_BUS;
+        if (strncmp(p.name, newp->name, XAI_MOUSE_LL_DATA_LENGTH) != 0)
+            return RET_ERROR_VERIFY;
+    }
+
+    if (((f & PROFILE_FIELD_CPI1) == PROFILE_FIELD_CPI1 &&
+                p.cpi[0] != newp->cpi[0]) ||
+            ((f & PROFILE_FIELD_CPI2) == PROFILE_FIELD_CPI2 &&
+                p.cpi[1] != newp->cpi[1]) ||
+            ((f & PROFILE_FIELD_RATE) == PROFILE_FIELD_RATE &&
+                p.rate != newp->rate) ||
+            ((f & PROFILE_FIELD_AIM) == PROFILE_FIELD_AIM &&
+                p.aim != newp->aim) ||
+            ((f & PROFILE_FIELD_ACCEL) == PROFILE_FIELD_ACCEL &&
+                p.accel != newp->accel) ||
+            ((f & PROFILE_FIELD_FREEMOVE) == PROFILE_FIELD_FREEMOVE &&
+                p.freemove != newp->freemove) ||
+            ((f & PROFILE_FIELD_LCD_BRIGHTNESS) == PROFILE_FIELD_LCD_BRIGHTNESS &&
+                p.lcd_brightness != newp->lcd_brightness) ||
+            ((f & PROFILE_FIELD_LCD_CONTRAST) == PROFILE_FIELD_LCD_CONTRAST &&
+                p.lcd_contrast != newp->lcd_contrast))
+        return RET_ERROR_VERIFY;
+
+    for (i = 0; i < XAI_MOUSE_BUTTON_NUM; i++) {
+        if ((f & button_fields[i]) == button_fields[i] &&
+                p.button[i] != newp->button[i])
+            return RET_ERROR_VERIFY;
+    }
+
+    if (ctx->set_current_profile) {
+        if (xai_profile_get_current_index(ctx, &cur) != RET_OK)
+            return RET_ERROR_BUS;
+        if (cur != index)
+            return RET_ERROR_VERIFY;
+    }
+
+    return RET_OK;
+}
+
+
+/*
+ * Transaction plan: the list of requests a command issues on the bus.
+ * Reads come first (only what is not known yet), then settings writes,
+ * current profile reload, name, and a single flash commit. Writes are
+ * sent as one batch, journaled when it is saved to flash (see
+ * xai_journal_begin).
+ */
+static void xai_plan_add (struct xai_plan *plan, unsigned char operation,
+        int part, int index, int flags, struct xai_profile *changes)
+{
+    struct xai_plan_step *s;
+
+    if (plan->count >= XAI_PLAN_MAX) {
+        plan->overflow = 1;
+        return;
+    }
+
+    s = &plan->steps[plan->count++];
+    s->operation = operation;
+    s->part = (unsigned char)part;
+    s->index = (unsigned char)index;
+    s->flags = (unsigned char)flags;
+    s->changes = changes;
+    s->data = NULL;
+}
+
+/*
+ * \param[in] targets Bit n set for 0-based profile index n
+ * \param[in] newp Requested changes, NULL to read entire mouse configuration
+ */
+static void xai_plan_build (struct xai_context *ctx, unsigned int targets,
+        struct xai_profile *newp, struct xai_plan *plan)
+{
+    struct xai_profile *changes[XAI_MOUSE_PROFILE_NUM];
+    int i, part;
+
+    if (newp == NULL) {
+        plan->count = 0;
+        plan->overflow = 0;
+        plan->targets = 0;
+
+        xai_plan_add(plan, XAI_MOUSE_LL_HANDSHAKE, 0, 0, 0, NULL);
+        for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++)
+            xai_plan_add(plan, XAI_MOUSE_LL_GET_PROFILE_NAME, 0, i, 0, NULL);
+        for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++)
+            for (part = 1; part <= 3; part++)
+                xai_plan_add(plan, XAI_MOUSE_LL_GET_PROFILE_SETTINGS, part, i,
+                        0, NULL);
+        xai_plan_add(plan, XAI_MOUSE_LL_GET_CURRENT_PROFILE, 0, 0, 0, NULL);
+        return;
+    }
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++)
+        changes[i] = (targets & (1 << i)) ? newp : NULL;
+
+    xai_plan_build_each(ctx, changes, plan);
+}
+
+/*
+ * Same as xai_plan_build, with a change set for each profile.
+ * \param[in] changes Indexed by 0-based profile number, NULL: not modified
+ */
+static void xai_plan_build_each (struct xai_context *ctx,
+        struct xai_profile *changes[], struct xai_plan *plan)
+{
+    struct xai_ll_message msg;
+    int i, part, writes, touched[XAI_MOUSE_PROFILE_NUM][3];
+
+    plan->count = 0;
+    plan->overflow = 0;
+    plan->targets = 0;
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
+        if (changes[i] == NULL)
+            continue;
+        plan->targets |= 1 << i;
+        for (part = 1; part <= 3; part++) {
+            memset(&msg, 0, sizeof(struct xai_ll_message));
+            touched[i][part - 1] = xai_profile_patch_part(changes[i], part, &msg);
+        }
+    }
+
+    /* Nothing to change */
+    if (plan->targets == 0)
+        return;
+
+    if (!ctx->p_valid)
+        xai_plan_add(plan, XAI_MOUSE_LL_HANDSHAKE, 0, 0, 0, NULL);
+
+    /* Current profile must be reloaded if it is the modified one */
+    if (!ctx->p_valid && !ctx->set_current_profile)
+        xai_plan_add(plan, XAI_MOUSE_LL_GET_CURRENT_PROFILE, 0, 0, 0, NULL);
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
+        if (changes[i] == NULL)
+            continue;
+        for (part = 1; part <= 3; part++)
+            if (touched[i][part - 1] &&
+                    !(ctx->raw_valid[i] & (1 << (part - 1))))
+                xai_plan_add(plan, XAI_MOUSE_LL_GET_PROFILE_SETTINGS, part, i,
+                        0, NULL);
+        /* Old name is the undo image, see xai_plan_rollback */
+        if (!ctx->p_valid &&
+                (changes[i]->fields & PROFILE_FIELD_NAME) == PROFILE_FIELD_NAME)
+            xai_plan_add(plan, XAI_MOUSE_LL_GET_PROFILE_NAME, 0, i, 0, NULL);
+    }
+
+    writes = plan->count;
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
+        if (changes[i] == NULL)
+            continue;
+        for (part = 1; part <= 3; part++)
+            if (touched[i][part - 1])
+                xai_plan_add(plan, XAI_MOUSE_LL_SET_PROFILE_SETTINGS, part, i,
+                        0, changes[i]);
+    }
+
+    /* --current is only allowed with a single target */
+    if (ctx->set_current_profile) {
+        for (i = 0; i < XAI_MOUSE_PROFILE_NUM - 1 && changes[i] == NULL; )
+            i++;
+        xai_plan_add(plan, XAI_MOUSE_LL_SET_CURRENT_PROFILE, 0, i, 0, NULL);
+    }
+    else if (ctx->p_valid && (plan->targets & (1 << ctx->cur_index)))
+        xai_plan_add(plan, XAI_MOUSE_LL_SET_CURRENT_PROFILE, 0,
+                ctx->cur_index, 0, NULL);
+    else if (!ctx->p_valid)
+        xai_plan_add(plan, XAI_MOUSE_LL_SET_CURRENT_PROFILE, 0, 0,
+                XAI_PLAN_IF_CURRENT, NULL);
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++)
+        if (changes[i] != NULL &&
+                (changes[i]->fields & PROFILE_FIELD_NAME) == PROFILE_FIELD_NAME)
+            xai_plan_add(plan, XAI_MOUSE_LL_SET_PROFILE_NAME, 0, i, 0,
+                    changes[i]);
+
+    if (!ctx->no_flash && plan->count > writes)
+        xai_plan_add(plan, XAI_MOUSE_LL_SAVE_TO_FLASH, 0, 0, 0, NULL);
+}
+
+/* Transfers needed without retry: request + answer (handshake has none) */
+static int xai_plan_transfers (struct xai_plan *plan)
+{
+    int i, n = 0;
+
+    for (i = 0; i < plan->count; i++)
+        n += (plan->steps[i].operation == XAI_MOUSE_LL_HANDSHAKE) ? 1 : 2;
+
+    return n;
+}
+
+static void xai_plan_print (FILE *out, struct xai_plan *plan)
+{
+    struct xai_plan_step *s;
+    const char *name;
+    int i, n = xai_plan_transfers(plan);
+
+    fprintf(out, "step  opcode  operation              profile  part\n");
+
+    for (i = 0; i < plan->count; i++) {
+        s = &plan->steps[i];
+
+        switch (s->operation) {
+            case XAI_MOUSE_LL_HANDSHAKE:
+                name = "handshake"; break;
+            case XAI_MOUSE_LL_GET_PROFILE_NAME:
+                name = "get name"; break;
+            case XAI_MOUSE_LL_GET_PROFILE_SETTINGS:
+                name = "get settings"; break;
+            case XAI_MOUSE_LL_GET_CURRENT_PROFILE:
+                name = "get current profile"; break;
+            case XAI_MOUSE_LL_SET_PROFILE_SETTINGS:
+                name = (s->flags & XAI_PLAN_IF_DIFFERS) ?
+                    "set settings (diff)" : "set settings"; break;
+            case XAI_MOUSE_LL_SET_CURRENT_PROFILE:
+                name = (s->flags &
+                        (XAI_PLAN_IF_CURRENT | XAI_PLAN_IF_WRITTEN)) ?
+                    "set current (if so)" : "set current profile"; break;
+            case XAI_MOUSE_LL_SET_PROFILE_NAME:
+                name = (s->flags & XAI_PLAN_IF_DIFFERS) ?
+                    "set name (diff)" : "set name"; break;
+            case XAI_MOUSE_LL_SAVE_TO_FLASH:
+                name = "save to flash"; break;
+            default:
+                name = "?"; break;
+        }
+
+        fprintf(out, "%4d  0x%02X    %-21s  ", i + 1, s->operation, name);
+
+        if (s->operation == XAI_MOUSE_LL_HANDSHAKE ||
+                s->operation == XAI_MOUSE_LL_GET_CURRENT_PROFILE ||
+                s->operation == XAI_MOUSE_LL_SAVE_TO_FLASH ||
+                (s->flags & XAI_PLAN_IF_CURRENT))
+            fprintf(out, "      -     -\n");
+        else if (s->part == 0)
+            fprintf(out, "%7d     -\n", s->index + 1);
+        else
+            fprintf(out, "%7d  %4d\n", s->index + 1, s->part);
+    }
+
+    fprintf(out, "%d steps, %d transfers, ~%d ms (estimated, without retry)\n",
+            plan->count, n, n * XAI_PLAN_TRANSFER_US / 1000);
+}
+
+/*
+ * Execute a plan. Read steps are retried, write steps are collected and
+ * sent in one batch, followed by flash commit (if any).
+ */
+static int xai_plan_run (struct xai_context *ctx, struct xai_plan *plan)
+{
+    struct xai_ll_message msgs[XAI_JOURNAL_MAX];
+    struct xai_ll_message undo[XAI_JOURNAL_MAX];
+    struct xai_ll_message msg;
+    struct xai_plan_step *s;
+    int i, tries, cur, count = 0, flash = 0, written = 0, ret = RET_OK;
+    int cur_known = ctx->p_valid, ret2;
+    unsigned int names = ctx->p_valid ? ~0U : 0;
+    unsigned char bit;
+
+    plan->sent = 0;
+    if (plan->overflow) {
+        fprintf(stderr, "%s: too many requests (%d max)\n",
+                XAI_MOUSE_PROGRAM_NAME, XAI_PLAN_MAX);
+        return RET_ERROR_WRONG_PARAMETER;
+    }
+
+    for (i = 0; (i < plan->count) && (ret == RET_OK); i++) {
+        s = &plan->steps[i];
+        tries = XAI_PLAN_TRIES;
+
+        /* each write message takes a journal entry */
+        if (count >= XAI_JOURNAL_MAX &&
+                (s->operation == XAI_MOUSE_LL_SET_PROFILE_SETTINGS ||
+                 s->operation == XAI_MOUSE_LL_SET_CURRENT_PROFILE ||
+                 s->operation == XAI_MOUSE_LL_SET_PROFILE_NAME)) {
+            fprintf(stderr, "%s: too many writes in one batch (%d max)\n",
+                    XAI_MOUSE_PROGRAM_NAME, XAI_JOURNAL_MAX);
+            return RET_ERROR_WRONG_PARAMETER;
+        }
+
+        xai_phase_begin(ctx);
+
+        switch (s->operation) {
+            case XAI_MOUSE_LL_HANDSHAKE:
+                ret = xai_device_handshake(ctx);
+                xai_phase_end(ctx, XAI_PHASE_HANDSHAKE, 0);
+                break;
+
+            case XAI_MOUSE_LL_GET_PROFILE_NAME:
+                while (((ret = xai_profile_get_name(ctx, s->index,
+                                    &ctx->p[s->index])) != RET_OK) &&
+                        (--tries > 0));
+                if (ret == RET_OK)
+                    names |= 1 << s->index;
+                xai_phase_end(ctx, XAI_PHASE_NAMES, XAI_PLAN_TRIES - tries);
+                break;
+
+            case XAI_MOUSE_LL_GET_PROFILE_SETTINGS:
+                while (((ret = xai_profile_read_part(ctx, s->index, s->part,
+                                    &msg)) != RET_OK) && (--tries > 0));
+                if (ret == RET_OK)
+                    xai_profile_decode_part(&ctx->p[s->index], s->part, &msg);
+                xai_phase_end(ctx, XAI_PHASE_CONFIGS, XAI_PLAN_TRIES - tries);
+                break;
+
+            case XAI_MOUSE_LL_GET_CURRENT_PROFILE:
+                cur = XAI_MOUSE_PROFILE_NUM; // out of bound index
+                ret = xai_profile_get_current_index(ctx, &cur);
+                if (ret == RET_OK) {
+                    ctx->cur_index = (unsigned char)cur;
+                    cur_known = 1;
+                }
+                xai_phase_end(ctx, XAI_PHASE_CONFIGS, 0);
+                break;
+
+            case XAI_MOUSE_LL_SET_PROFILE_SETTINGS:
+                bit = (unsigned char)(1 << (s->part - 1));
+                if (s->data == NULL) {
+                    ret = xai_profile_compose_part(ctx, s->index, s->part,
+                            s->changes, &msgs[count]);
+                } else if ((s->flags & XAI_PLAN_IF_DIFFERS) &&
+                        (ctx->raw_valid[s->index] & bit) &&
+                        memcmp(ctx->raw[s->index][s->part - 1], s->data,
+                            XAI_MOUSE_LL_DATA_LENGTH) == 0) {
+                    break;
+                } else {
+                    memset(&msgs[count], 0, sizeof(struct xai_ll_message));
+                    msgs[count].header.operation =
+                        XAI_MOUSE_LL_SET_PROFILE_SETTINGS;
+                    msgs[count].header.part = s->part;
+                    msgs[count].header.argument1 = s->index;
+                    memcpy(msgs[count].u.data, s->data,
+                            XAI_MOUSE_LL_DATA_LENGTH);
+                }
+                if (ret == RET_OK) {
+                    count++;
+                    written = 1;
+                }
+                break;
+
+            case XAI_MOUSE_LL_SET_CURRENT_PROFILE:
+                if ((s->flags & XAI_PLAN_IF_WRITTEN) && !written)
+                    break;
+                if (!(s->flags & XAI_PLAN_IF_CURRENT))
+                    xai_profile_compose_current_index(ctx, s->index,
+                            &msgs[count++]);
+                else if (ctx->cur_index < XAI_MOUSE_PROFILE_NUM &&
+                        (plan->targets & (1 << ctx->cur_index)))
+                    xai_profile_compose_current_index(ctx, ctx->cur_index,
+                            &msgs[count++]);
+                break;
+
+            case XAI_MOUSE_LL_SET_PROFILE_NAME:
+                if ((s->flags & XAI_PLAN_IF_DIFFERS) &&
+                        (names & (1 << s->index)) &&
+                        strncmp(ctx->p[s->index].name, s->changes->name,
+                            XAI_MOUSE_LL_DATA_LENGTH - 5) == 0)
+                    break;
+                xai_profile_compose_name(ctx, s->index, s->changes,
+                        &msgs[count++]);
+                break;
+
+            case XAI_MOUSE_LL_SAVE_TO_FLASH:
+                flash = 1;
+                break;
+        }
+    }
+
+    if (ret != RET_OK) {
+        if (plan->targets != 0)
+            fprintf(stderr, "%s: error in xai_plan_run, step %d (%d)\n",
+                    XAI_MOUSE_PROGRAM_NAME, i, ret);
+        return ret;
+    }
+
+    /* Read-only plan, or nothing to change */
+    if (count == 0)
+        return RET_OK;
+
+    xai_plan_undo_prepare(ctx, msgs, count, names, undo);
+    xai_phase_begin(ctx);
+    /* RAM only batch (--no-flash, --live): lost on power off anyway */
+    if (flash)
+        xai_journal_begin(ctx, msgs, count, flash);
+    else
+        ctx->journal_fd = -1;
+
+    for (i = 0; i < count && ret == RET_OK; i++) {
+        ctx->journal_base = i;
+        ret = xai_device_send(ctx, &msgs[i], 1);
+    }
+    xai_phase_end(ctx, XAI_PHASE_WRITES, 0);
+
+    if (ret != RET_OK) {
+        fprintf(stderr, "%s: error in xai_device_send (%d), message %d of %d, "
+                "rolling back\n", XAI_MOUSE_PROGRAM_NAME, ret, i, count);
+        xai_phase_begin(ctx);
+        ret2 = xai_plan_rollback(ctx, undo, i - 1, cur_known, flash);
+        xai_phase_end(ctx, XAI_PHASE_WRITES, 0);
+        if (ret2 == RET_OK)
+            fprintf(stderr, "%s: changes rolled back, nothing saved to "
+                    "flash\n", XAI_MOUSE_PROGRAM_NAME);
+        else if (flash)
+            fprintf(stderr, "%s: rollback incomplete, it will be resumed on "
+                    "next run\n", XAI_MOUSE_PROGRAM_NAME);
+        else
+            fprintf(stderr, "%s: rollback incomplete\n",
+                    XAI_MOUSE_PROGRAM_NAME);
+        return ret;
+    }
+
+    plan->sent = count;
+    if (flash) {
+        xai_phase_begin(ctx);
+        ret = xai_device_write_to_flash(ctx);
+        xai_phase_end(ctx, XAI_PHASE_FLASH, 0);
+        if (ret != RET_OK) {
+            fprintf(stderr, "%s: error in xai_device_write_to_flash (%d)\n",
+                    XAI_MOUSE_PROGRAM_NAME, ret);
+            return ret;
+        }
+    }
+
+    xai_journal_end(ctx);
+    return ret;
+}
+
+
+/*
+ * Undo image of a batch: for each message, the one restoring what it
+ * overwrites. Settings parts come from the cache (device content before
+ * the batch), names from ctx->p; operation is 0 when unknown. Current
+ * profile is handled by xai_plan_rollback.
+ * \param[in] names Bit n set if ctx->p[n].name has been read
+ */
+static void xai_plan_undo_prepare (struct xai_context *ctx,
+        struct xai_ll_message *msgs, int count, unsigned int names,
+        struct xai_ll_message *undo)
+{
+    int i, index, part;
+
+    for (i = 0; i < count; i++) {
+        memset(&undo[i], 0, sizeof(struct xai_ll_message));
+        index = msgs[i].header.argument1;
+        part = msgs[i].header.part;
+
+        switch (msgs[i].header.operation) {
+            case XAI_MOUSE_LL_SET_PROFILE_SETTINGS:
+                if (index < XAI_MOUSE_PROFILE_NUM && part >= 1 && part <= 3 &&
+                        (ctx->raw_valid[index] & (1 << (part - 1)))) {
+                    undo[i] = msgs[i];
+                    memcpy(undo[i].u.data, ctx->raw[index][part - 1],
+                            XAI_MOUSE_LL_DATA_LENGTH);
+                }
+                break;
+
+            case XAI_MOUSE_LL_SET_PROFILE_NAME:
+                if (index < XAI_MOUSE_PROFILE_NUM && (names & (1 << index)))
+                    xai_profile_compose_name(ctx, index, &ctx->p[index],
+                            &undo[i]);
+                break;
+        }
+    }
+}
+
+/*
+ * A batch failed: restore (in reverse order) what messages 0 to last
+ * (included, it may have been taken into account) have overwritten, then
+ * reload the original current profile. Flash is not touched, so nothing
+ * of the failed change is persisted. Undo messages are journaled (without
+ * flash commit) if the batch was: if they can't be sent now, next run
+ * does it.
+ * \param[in] last Index of failed message
+ * \param[in] cur_known ctx->cur_index is the current profile before batch
+ * \param[in] journal Journal undo messages
+ */
+static int xai_plan_rollback (struct xai_context *ctx,
+        struct xai_ll_message *undo, int last, int cur_known, int journal)
+{
+    struct xai_ll_message msgs[XAI_JOURNAL_MAX + 1];
+    int i, count = 0, ret;
+
+    if (last >= XAI_JOURNAL_MAX)
+        last = XAI_JOURNAL_MAX - 1;
+
+    for (i = last; i >= 0; i--)
+        if (undo[i].header.operation != 0)
+            msgs[count++] = undo[i];
+
+    if (cur_known && ctx->cur_index < XAI_MOUSE_PROFILE_NUM)
+        xai_profile_compose_current_index(ctx, ctx->cur_index,
+                &msgs[count++]);
+
+    if (ctx->journal_fd >= 0) {
+        close(ctx->journal_fd);
+        ctx->journal_fd = -1;
+    }
+
+    if (journal)
+        xai_journal_begin(ctx, msgs, count, 0);
+
+    ret = xai_device_send(ctx, msgs, count);
+    if (ret == RET_OK)
+        xai_journal_end(ctx);
+
+    return ret;
+}
+
+
+/*
+ * Declarative configuration (--apply): desired state of profiles, INI
+ * like. Keys are long option names, roles are button names:
+ *
+ *   # comment
+ *   [profile 1]
+ *   name = Work
+ *   c1 = 800
+ *   b3 = middle
+ *
+ * Profiles (and fields) not described are left as they are. Device state
+ * is read once, and only the fields that differ are written (no message
+ * at all when the device is already up to date).
+ */
+#define XAI_CONFIG_LINE_MAX           256
+
+/*
+ * Drop from want the fields which already have the requested value.
+ * \return Fields still to be changed (0: up to date)
+ */
+static unsigned long xai_profile_diff (const struct xai_profile *cur,
+        struct xai_profile *want)
+{
+    unsigned long f = want->fields;
+    int i;
+
+    if ((f & PROFILE_FIELD_NAME) == PROFILE_FIELD_NAME &&
+            strncmp(cur->name, want->name, XAI_MOUSE_LL_DATA_LENGTH - 5) == 0)
+        f &= ~(PROFILE_FIELD_NAME & ~PROFILE_FIELD_MASK);
+    if ((f & PROFILE_FIELD_CPI1) == PROFILE_FIELD_CPI1 &&
+            cur->cpi[0] == want->cpi[0])
+        f &= ~(PROFILE_FIELD_CPI1 & ~PROFILE_FIELD_MASK);
+    if ((f & PROFILE_FIELD_CPI2) == PROFILE_FIELD_CPI2 &&
+            cur->cpi[1] == want->cpi[1])
+        f &= ~(PROFILE_FIELD_CPI2 & ~PROFILE_FIELD_MASK);
+    if ((f & PROFILE_FIELD_RATE) == PROFILE_FIELD_RATE &&
+            cur->rate == want->rate)
+        f &= ~(PROFILE_FIELD_RATE & ~PROFILE_FIELD_MASK);
+    if ((f & PROFILE_FIELD_AIM) == PROFILE_FIELD_AIM &&
+            cur->aim == want->aim)
+        f &= ~(PROFILE_FIELD_AIM & ~PROFILE_FIELD_MASK);
+    if ((f & PROFILE_FIELD_ACCEL) == PROFILE_FIELD_ACCEL &&
+            cur->accel == want->accel)
+        f &= ~(PROFILE_FIELD_ACCEL & ~PROFILE_FIELD_MASK);
+    if ((f & PROFILE_FIELD_FREEMOVE) == PROFILE_FIELD_FREEMOVE &&
+            cur->freemove == want->freemove)
+        f &= ~(PROFILE_FIELD_FREEMOVE & ~PROFILE_FIELD_MASK);
+    if ((f & PROFILE_FIELD_LCD_BRIGHTNESS) == PROFILE_FIELD_LCD_BRIGHTNESS &&
+            cur->lcd_brightness == want->lcd_brightness)
+        f &= ~(PROFILE_FIELD_LCD_BRIGHTNESS & ~PROFILE_FIELD_MASK);
+    if ((f & PROFILE_FIELD_LCD_CONTRAST) == PROFILE_FIELD_LCD_CONTRAST &&
+            cur->lcd_contrast == want->lcd_contrast)
+        f &= ~(PROFILE_FIELD_LCD_CONTRAST & ~PROFILE_FIELD_MASK);
+
+    for (i = 0; i < XAI_MOUSE_BUTTON_NUM; i++) {
+        if ((f & button_fields[i]) == button_fields[i] &&
+                cur->button[i] == want->button[i])
+            f &= ~(button_fields[i] & ~PROFILE_FIELD_MASK);
+    }
+
+    want->fields = f;
+    return f & ~PROFILE_FIELD_MASK;
+}
+
+/* Print names of fields (" c1 rate b3") */
+static void xai_profile_fields_print (FILE *out, unsigned long fields)
+{
+    int i;
+
+    for (i = 0; field_names[i].name != NULL; i++)
+        if ((fields & field_names[i].field & ~PROFILE_FIELD_MASK) != 0)
+            fprintf(out, " %s", field_names[i].name);
+}
+
+/*
+ * Load a configuration file. Syntax errors are fatal (unlike command line
+ * options, an invalid value is not ignored).
+ * \param[out] desired Indexed by 0-based profile number
+ */
+static int xai_config_load (const char *path, struct xai_profile desired[])
+{
+    char buf[XAI_CONFIG_LINE_MAX];
+    struct xai_profile tmp;
+    char *line, *end;
+    FILE *fp;
+    int n = 0, index = -1, ret = RET_OK;
+
+    memset(desired, 0, XAI_MOUSE_PROFILE_NUM * sizeof(struct xai_profile));
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "%s: can't open %s (%s)\n", XAI_MOUSE_PROGRAM_NAME,
+                path, strerror(errno));
+        return RET_ERROR_SYSTEM;
+    }
+
+    while (ret == RET_OK && fgets(buf, sizeof(buf), fp) != NULL) {
+        n++;
+
+        for (line = buf; *line == ' ' || *line == '\t'; )
+            line++;
+        if (*line == '#' || *line == ';' || *line == '\n' || *line == '\r' ||
+                *line == '\0')
+            continue;
+
+        if (*line == '[') {
+            end = strchr(line, ']');
+            if (end == NULL || sscanf(line, "[profile %d", &index) != 1 ||
+                    index < 1 || index > XAI_MOUSE_PROFILE_NUM) {
+                fprintf(stderr, "%s: %s:%d: invalid section (expecting "
+                        "[profile 1] to [profile %d])\n", XAI_MOUSE_PROGRAM_NAME,
+                        path, n, XAI_MOUSE_PROFILE_NUM);
+                ret = RET_ERROR_WRONG_PARAMETER;
+            }
+            index--;
+            continue;
+        }
+
+        if (index < 0) {
+            fprintf(stderr, "%s: %s:%d: setting outside of a [profile N] "
+                    "section\n", XAI_MOUSE_PROGRAM_NAME, path, n);
+            ret = RET_ERROR_WRONG_PARAMETER;
+            continue;
+        }
+
+        tmp = desired[index];
+        tmp.fields = 0;
+        if (xai_profile_change_line(&tmp, line) != RET_OK) {
+            fprintf(stderr, "%s: %s:%d: unknown setting\n",
+                    XAI_MOUSE_PROGRAM_NAME, path, n);
+            ret = RET_ERROR_WRONG_PARAMETER;
+        } else if ((tmp.fields & ~PROFILE_FIELD_MASK) == 0) {
+            fprintf(stderr, "%s: %s:%d: invalid value\n",
+                    XAI_MOUSE_PROGRAM_NAME, path, n);
+            ret = RET_ERROR_WRONG_PARAMETER;
+        } else {
+            tmp.fields |= desired[index].fields;
+            desired[index] = tmp;
+        }
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+/*
+ * Converge device (read by xai_device_init) to desired state: one plan for
+ * every out of date profile, a single flash commit.
+ * \param[in] desired As loaded by xai_config_load, modified (only fields
+ *                    to change are kept)
+ */
+static int xai_config_apply (struct xai_context *ctx,
+        struct xai_profile desired[])
+{
+    struct xai_profile *changes[XAI_MOUSE_PROFILE_NUM];
+    struct xai_plan plan;
+    unsigned long f;
+    int i, ret;
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
+        changes[i] = NULL;
+        if (desired[i].fields == 0)
+            continue;
+
+        f = xai_profile_diff(&ctx->p[i], &desired[i]);
+        if (f == 0)
+            continue;
+
+        changes[i] = &desired[i];
+        fprintf(stdout, "profile %d:", i + 1);
+        xai_profile_fields_print(stdout, f);
+        fprintf(stdout, "\n");
+    }
+
+    xai_plan_build_each(ctx, changes, &plan);
+
+    if (plan.count == 0) {
+        fprintf(stdout, "up to date\n");
+        return RET_OK;
+    }
+
+    if (ctx->dry_run) {
+        xai_plan_print(stdout, &plan);
+        return RET_OK;
+    }
+
+    ret = xai_plan_run(ctx, &plan);
+    if (ret == RET_OK)
+        fprintf(stdout, "%d request(s) sent\n", plan.sent);
+
+    return ret;
+}
+
+
+/*
+ * Live mode (--live): change requests ("key=value" lines) are read from
+ * standard input and applied to RAM settings right away. Lines already
+ * queued are coalesced (last value of each field wins) and sent as one
+ * batch. Flash commit is deferred until no change has been received for
+ * --flash-delay milliseconds, or until exit (end of input, SIGINT,
+ * SIGTERM). A batch (or commit) that fails is retried a little later,
+ * with the changes received meanwhile; the session ends after
+ * XAI_LIVE_FAILURES_MAX failures in a row.
+ */
+#define XAI_LIVE_FLASH_DELAY          2000 /* ms */
+#define XAI_LIVE_RETRY_DELAY          500  /* ms */
+#define XAI_LIVE_FAILURES_MAX         5
+#define XAI_LIVE_LINE_MAX             256
+
+static volatile sig_atomic_t live_stop;
+
+static void xai_live_signal (int sig)
+{
+    (void)sig;
+    live_stop = 1;
+}
+
+/* Send pending changes to RAM (no flash commit), kept on failure */
+static int xai_live_apply (struct xai_context *ctx, int index,
+        struct xai_profile *newp)
+{
+    int no_flash = ctx->no_flash, ret;
+
+    ctx->no_flash = 1;
+    ret = xai_profile_apply(ctx, 1 << index, newp);
+    ctx->no_flash = no_flash;
+
+    if (ret == RET_OK)
+        memset(newp, 0, sizeof(struct xai_profile));
+    return ret;
+}
+
+/* \param[in] initial Changes given on command line (sent first) */
+static int xai_live_run (struct xai_context *ctx, int index,
+        struct xai_profile *initial)
+{
+    char buf[XAI_LIVE_LINE_MAX];
+    struct xai_profile newp;
+    struct sigaction sa;
+    struct pollfd pfd;
+    size_t len = 0;
+    ssize_t r;
+    char *line, *nl;
+    int n, timeout, dirty = 0, eof = 0, failures = 0, ret = RET_OK;
+    unsigned long lines = 0, batches = 0, commits = 0, failed = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = xai_live_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    newp = *initial;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+
+    while (!eof && !live_stop) {
+        if (failures > 0 && ((newp.fields & ~PROFILE_FIELD_MASK) || dirty))
+            timeout = XAI_LIVE_RETRY_DELAY;
+        else if ((newp.fields & ~PROFILE_FIELD_MASK) != 0)
+            timeout = 0;                 /* send once input is drained */
+        else if (dirty)
+            timeout = ctx->flash_delay;  /* commit when quiet */
+        else
+            timeout = -1;
+
+        n = poll(&pfd, 1, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = RET_ERROR_SYSTEM;
+            break;
+        }
+
+        if (n == 0) {
+            if ((newp.fields & ~PROFILE_FIELD_MASK) != 0) {
+                ret = xai_live_apply(ctx, index, &newp);
+                if (ret == RET_OK) {
+                    batches++;
+                    dirty = !ctx->no_flash;
+                }
+            } else if (dirty) {
+                ret = xai_device_write_to_flash(ctx);
+                if (ret == RET_OK) {
+                    commits++;
+                    dirty = 0;
+                }
+            }
+
+            if (ret == RET_OK) {
+                failures = 0;
+            } else {
+                failed++;
+                if (++failures >= XAI_LIVE_FAILURES_MAX)
+                    break;
+                fprintf(stderr, "%s: changes not applied (%d), retrying\n",
+                        XAI_MOUSE_PROGRAM_NAME, ret);
+                ret = RET_OK;
+            }
+            continue;
+        }
+
+        r = read(STDIN_FILENO, buf + len, sizeof(buf) - 1 - len);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            eof = 1;
+            break;
+        }
+        len += (size_t)r;
+        buf[len] = '\0';
+
+        for (line = buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+            *nl = '\0';
+            if (*line == '\0' || *line == '#')
+                continue;
+            lines++;
+            if (xai_profile_change_line(&newp, line) != RET_OK)
+                fprintf(stderr, "%s: invalid change request (%s)\n",
+                        XAI_MOUSE_PROGRAM_NAME, line);
+        }
+
+        len -= (size_t)(line - buf);
+        memmove(buf, line, len);
+
+        if (len == sizeof(buf) - 1) {
+            fprintf(stderr, "%s: line too long, ignored\n",
+                    XAI_MOUSE_PROGRAM_NAME);
+            len = 0;
+        }
+    }
+
+    if (ret == RET_OK && (newp.fields & ~PROFILE_FIELD_MASK) != 0) {
+        ret = xai_live_apply(ctx, index, &newp);
+        if (ret == RET_OK) {
+            batches++;
+            dirty = !ctx->no_flash;
+        }
+    }
+
+    /* Even after a failure, keep what has been applied */
+    if (dirty && xai_device_write_to_flash(ctx) == RET_OK)
+        commits++;
+
+    if (ctx->usb_debug)
+        fprintf(stderr, "%s: %lu change(s) received, %lu batch(es) sent, "
+                "%lu flash commit(s), %lu failure(s)\n",
+                XAI_MOUSE_PROGRAM_NAME, lines, batches, commits, failed);
+
+    return ret;
+}
+
+
+/*
+ * Drift watchdog (--watch=SEC): the state of watched profiles at start
+ * (after --apply, if given) is the desired state. Each profile is read
+ * back once per SEC seconds; checks are spread over the interval (one
+ * profile at a time), and the device is released between checks so other
+ * sessions are not delayed. A profile has drifted when the fingerprint of
+ * its settings parts and name changes. Drifted fields are reported, and
+ * written back with --watch-fix.
+ */
+#define XAI_WATCH_CHECK_TRANSFERS     9    /* handshake, 3 parts and name */
+#define XAI_WATCH_TRANSFER_BYTES      (LIBUSB_CONTROL_SETUP_SIZE + PACKET_SIZE)
+
+/* FNV-1a over raw settings parts and name */
+static unsigned int xai_watch_fingerprint (
+        unsigned char raw[3][XAI_MOUSE_LL_DATA_LENGTH], const char *name)
+{
+    unsigned int h = 2166136261U;
+    int i, part;
+
+    for (part = 0; part < 3; part++)
+        for (i = 0; i < XAI_MOUSE_LL_DATA_LENGTH; i++)
+            h = (h ^ raw[part][i]) * 16777619U;
+
+    for (i = 0; i < XAI_MOUSE_LL_DATA_LENGTH && name[i] != '\0'; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619U;
+
+    return h;
+}
+
+static int xai_watch_open (struct xai_context *ctx)
+{
+    int ret;
+
+    if (ctx->simulate)
+        ret = xai_sim_init(ctx->sim_fault_rate, ctx);
+    else
+        ret = xai_init(XAI_MOUSE_VENDOR_ID, XAI_MOUSE_PRODUCT_ID,
+                XAI_MOUSE_INTERFACE_NUM, ctx);
+
+    if (ret == RET_OK && (ret = xai_journal_recover(ctx)) != RET_OK)
+        xai_uninit(ctx);
+
+    return ret;
+}
+
+/*
+ * Read back one profile, compare with desired state.
+ * \param[in] index 0-based profile number
+ * \return RET_OK, RET_ERROR_VERIFY (drift) or error
+ */
+static int xai_watch_check (struct xai_context *ctx, int index,
+        struct xai_profile *want, unsigned int fp)
+{
+    struct xai_profile *changes[XAI_MOUSE_PROFILE_NUM];
+    struct xai_profile p, fix;
+    struct xai_ll_message msg;
+    struct xai_plan plan;
+    unsigned long f;
+    int i, part, tries, ret;
+
+    if ((ret = xai_watch_open(ctx)) != RET_OK)
+        return ret;
+
+    /* Nothing known from previous sessions */
+    ctx->p_valid = 0;
+    memset(ctx->raw_valid, 0, sizeof(ctx->raw_valid));
+    memset(&p, 0, sizeof(struct xai_profile));
+
+    ret = xai_device_handshake(ctx);
+
+    for (part = 1; part <= 3 && ret == RET_OK; part++) {
+        tries = XAI_PLAN_TRIES;
+        while (((ret = xai_profile_read_part(ctx, index, part, &msg))
+                    != RET_OK) && (--tries > 0));
+        if (ret == RET_OK)
+            xai_profile_decode_part(&p, part, &msg);
+    }
+
+    if (ret == RET_OK) {
+        tries = XAI_PLAN_TRIES;
+        while (((ret = xai_profile_get_name(ctx, index, &p)) != RET_OK) &&
+                (--tries > 0));
+    }
+
+    if (ret != RET_OK ||
+            xai_watch_fingerprint(ctx->raw[index], p.name) == fp) {
+        xai_uninit(ctx);
+        return ret;
+    }
+
+    fix = *want;
+    f = xai_profile_diff(&p, &fix);
+
+    fprintf(stdout, "profile %d: drift", index + 1);
+    if (f != 0)
+        xai_profile_fields_print(stdout, f);
+    else
+        fprintf(stdout, " (unknown bytes)");
+
+    if (ctx->watch_fix && f != 0) {
+        for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++)
+            changes[i] = (i == index) ? &fix : NULL;
+        xai_plan_build_each(ctx, changes, &plan);
+        ret = xai_plan_run(ctx, &plan);
+        fprintf(stdout, ", %s", (ret == RET_OK) ? "fixed" : "fix failed");
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);
+
+    xai_uninit(ctx);
+    return (ret == RET_OK) ? RET_ERROR_VERIFY : ret;
+}
+
+/*
+ * Device session must be open (and state read), it is released on return.
+ * Stops on SIGINT or SIGTERM.
+ * \param[in] targets Bit n set for 0-based profile index n
+ */
+static int xai_watch_run (struct xai_context *ctx, unsigned int targets)
+{
+    struct xai_profile want[XAI_MOUSE_PROFILE_NUM];
+    unsigned int fp[XAI_MOUSE_PROFILE_NUM];
+    unsigned long fields = 0, checks = 0, drifts = 0, errors = 0;
+    unsigned long long start, next, now, slot_us;
+    struct sigaction sa;
+    int i, n = 0, index = -1, ret;
+
+    for (i = 0; field_names[i].name != NULL; i++)
+        fields |= field_names[i].field;
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
+        if (!(targets & (1 << i)))
+            continue;
+        want[i] = ctx->p[i];
+        want[i].fields = fields;
+        fp[i] = xai_watch_fingerprint(ctx->raw[i], ctx->p[i].name);
+        n++;
+    }
+
+    /* Between checks, mouse is driven by usbhid again (pointer works) */
+    ctx->usb_rebind = 1;
+    xai_uninit(ctx);
+
+    slot_us = (unsigned long long)ctx->watch * 1000000ULL / n;
+    fprintf(stdout, "watching %d profile(s), every %d s: one check each "
+            "%llu ms, ~%.2f transfers/s, ~%.0f bytes/s\n", n, ctx->watch,
+            slot_us / 1000, XAI_WATCH_CHECK_TRANSFERS * 1e6 / slot_us,
+            XAI_WATCH_CHECK_TRANSFERS * XAI_WATCH_TRANSFER_BYTES * 1e6 /
+            slot_us);
+    fflush(stdout);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = xai_live_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    ctx->stats.transfers = 0;
+    start = next = xai_time_us() + slot_us;
+
+    while (!live_stop) {
+        now = xai_time_us();
+        if (now < next) {
+            poll(NULL, 0, (int)((next - now + 999) / 1000));
+            continue;
+        }
+        next += slot_us;
+
+        do {
+            index = (index + 1) % XAI_MOUSE_PROFILE_NUM;
+        } while (!(targets & (1 << index)));
+
+        ret = xai_watch_check(ctx, index, &want[index], fp[index]);
+        checks++;
+        if (ret == RET_ERROR_VERIFY) {
+            drifts++;
+        } else if (ret != RET_OK) {
+            errors++;
+            fprintf(stderr, "%s: profile %d: check failed (%d)\n",
+                    XAI_MOUSE_PROGRAM_NAME, index + 1, ret);
+        }
+    }
+
+    now = xai_time_us();
+    fprintf(stdout, "%lu check(s), %lu drift(s), %lu error(s), %lu "
+            "transfers (%.0f bytes/s)\n", checks, drifts, errors,
+            ctx->stats.transfers, (now > start) ? ctx->stats.transfers *
+            (double)XAI_WATCH_TRANSFER_BYTES * 1e6 / (now - start) : 0.0);
+
+    return RET_OK;
+}
+
+
+/*
+ * Raw packet script (--raw), for protocol exploration and delay tuning.
+ * One operation per line, bytes in hex (0013, 00 13 or 0x00 0x13):
+ *
+ *   set BYTES...             SetReport, missing bytes are 00
+ *   get [PATTERN...]         GetReport, answer checked against pattern
+ *   wait PATTERN... [timeout US]
+ *                            GetReport until answer matches, back to back
+ *                            (default timeout 100000 us)
+ *   delay US                 sleep
+ *
+ * "??" in a pattern matches any byte; '#' starts a comment. Transfers go
+ * through xai_device_transfer_packet, nothing is added (no handshake).
+ */
+
+/*
+ * \param[in] pattern Accept ?? (wildcard)
+ * \return Number of bytes, or error code
+ */
+static int xai_raw_parse_bytes (char *str, struct xai_raw_step *step,
+        int pattern)
+{
+    char *tok, *save = NULL;
+    unsigned int v;
+    int n = 0;
+
+    for (tok = strtok_r(str, " \t\r\n", &save); tok != NULL;
+            tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (strncmp(tok, "0x", 2) == 0 || strncmp(tok, "0X", 2) == 0)
+            tok += 2;
+        if (*tok == '\0' || (strlen(tok) % 2) != 0)
+            return RET_ERROR_WRONG_PARAMETER;
+
+        for (; *tok != '\0'; tok += 2) {
+            if (n == PACKET_SIZE)
+                return RET_ERROR_WRONG_PARAMETER;
+            if (pattern && tok[0] == '?' && tok[1] == '?') {
+                step->mask[n++] = 0;
+                continue;
+            }
+            if (!isxdigit((unsigned char)tok[0]) ||
+                    !isxdigit((unsigned char)tok[1]) ||
+                    sscanf(tok, "%2x", &v) != 1)
+                return RET_ERROR_WRONG_PARAMETER;
+            step->data[n] = (unsigned char)v;
+            step->mask[n++] = 0xFF;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Load a raw packet script. Syntax errors are fatal.
+ * \param[out] count Number of steps
+ */
+static int xai_raw_load (const char *path, struct xai_raw_step steps[],
+        int *count)
+{
+    char buf[XAI_CONFIG_LINE_MAX];
+    struct xai_raw_step *s;
+    char *line, *cmd, *arg, *save = NULL, *end;
+    FILE *fp;
+    int n = 0, len, ret = RET_OK;
+
+    *count = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "%s: can't open %s (%s)\n", XAI_MOUSE_PROGRAM_NAME,
+                path, strerror(errno));
+        return RET_ERROR_SYSTEM;
+    }
+
+    while (ret == RET_OK && fgets(buf, sizeof(buf), fp) != NULL) {
+        n++;
+
+        if ((end = strchr(buf, '#')) != NULL)
+            *end = '\0';
+        if ((cmd = strtok_r(buf, " \t\r\n", &save)) == NULL)
+            continue;
+
+        if (*count == XAI_RAW_STEP_MAX) {
+            fprintf(stderr, "%s: %s:%d: too many steps (%d max)\n",
+                    XAI_MOUSE_PROGRAM_NAME, path, n, XAI_RAW_STEP_MAX);
+            ret = RET_ERROR_WRONG_PARAMETER;
+            break;
+        }
+
+        s = &steps[*count];
+        memset(s, 0, sizeof(struct xai_raw_step));
+        s->line = n;
+        line = save;
+        len = 0;
+
+        if (strcmp(cmd, "set") == 0) {
+            s->operation = XAI_RAW_SET;
+            len = xai_raw_parse_bytes(line, s, 0);
+            if (len == 0)
+                len = RET_ERROR_WRONG_PARAMETER;
+        } else if (strcmp(cmd, "get") == 0) {
+            s->operation = XAI_RAW_GET;
+            len = xai_raw_parse_bytes(line, s, 1);
+        } else if (strcmp(cmd, "wait") == 0) {
+            s->operation = XAI_RAW_WAIT;
+            s->us = XAI_POLL_TIMEOUT_US;
+            if ((arg = strstr(line, "timeout")) != NULL) {
+                *arg = '\0';
+                if (sscanf(arg + 7, "%lu", &s->us) != 1)
+                    len = RET_ERROR_WRONG_PARAMETER;
+            }
+            if (len == 0)
+                len = xai_raw_parse_bytes(line, s, 1);
+            if (len == 0)
+                len = RET_ERROR_WRONG_PARAMETER;
+        } else if (strcmp(cmd, "delay") == 0) {
+            s->operation = XAI_RAW_DELAY;
+            arg = strtok_r(NULL, " \t\r\n", &save);
+            if (arg == NULL || strspn(arg, "0123456789") != strlen(arg))
+                len = RET_ERROR_WRONG_PARAMETER;
+            else
+                s->us = strtoul(arg, NULL, 10);
+        } else {
+            fprintf(stderr, "%s: %s:%d: unknown operation (%s)\n",
+                    XAI_MOUSE_PROGRAM_NAME, path, n, cmd);
+            ret = RET_ERROR_WRONG_PARAMETER;
+            continue;
+        }
+
+        if (len < 0) {
+            fprintf(stderr, "%s: %s:%d: invalid %s arguments\n",
+                    XAI_MOUSE_PROGRAM_NAME, path, n, cmd);
+            ret = RET_ERROR_WRONG_PARAMETER;
+            continue;
+        }
+
+        s->len = len;
+        (*count)++;
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+/*
+ * Run a raw packet script, printing each step with its duration.
+ * A bus error stops the script; a mismatching answer does not.
+ */
+static int xai_raw_run (struct xai_context *ctx, struct xai_raw_step steps[],
+        int count)
+{
+    unsigned char packet[PACKET_SIZE];
+    unsigned long long start, t0, t1;
+    unsigned long polls, transfers = 0;
+    struct xai_raw_step *s;
+    int i, j, match, mismatches = 0, ret = RET_OK;
+
+    fprintf(stdout, "%4s  %4s  %-6s %-23s  %8s  %s\n", "step", "line", "op",
+            "bytes", "us", "result");
+
+    start = xai_time_us();
+
+    for (i = 0; i < count && ret == RET_OK; i++) {
+        s = &steps[i];
+        polls = 0;
+        match = 1;
+
+        t0 = xai_time_us();
+        switch (s->operation) {
+            case XAI_RAW_SET:
+                memset(packet, 0, PACKET_SIZE);
+                memcpy(packet, s->data, s->len);
+                ret = xai_device_transfer_packet(ctx, packet, PACKET_WRITE);
+                polls = 1;
+                break;
+
+            case XAI_RAW_GET:
+            case XAI_RAW_WAIT:
+                /* nothing prefilled: transfer__start reports zeroes */
+                memset(packet, 0, PACKET_SIZE);
+                do {
+                    ret = xai_device_transfer_packet(ctx, packet, PACKET_READ);
+                    polls++;
+                    for (j = 0, match = 1; j < s->len && match; j++)
+                        match = ((packet[j] ^ s->data[j]) & s->mask[j]) == 0;
+                } while (ret == RET_OK && !match &&
+                        s->operation == XAI_RAW_WAIT &&
+                        xai_time_us() - t0 < s->us);
+                break;
+
+            case XAI_RAW_DELAY:
+                usleep(s->us);
+                break;
+        }
+        t1 = xai_time_us();
+        transfers += polls;
+
+        fprintf(stdout, "%4d  %4d  %-6s", i + 1, s->line,
+                (s->operation == XAI_RAW_SET) ? "set" :
+                (s->operation == XAI_RAW_GET) ? "get" :
+                (s->operation == XAI_RAW_WAIT) ? "wait" : "delay");
+
+        /* first bytes sent or received */
+        for (j = 0; j < 8; j++)
+            if (s->operation == XAI_RAW_DELAY)
+                fputs("   ", stdout);
+            else
+                fprintf(stdout, " %02X", packet[j]);
+
+        fprintf(stdout, "  %8llu  ", t1 - t0);
+        if (ret != RET_OK)
+            fprintf(stdout, "bus error (%d)\n", ret);
+        else if (s->operation == XAI_RAW_WAIT)
+            fprintf(stdout, "%s after %lu poll(s)\n",
+                    match ? "match" : "timeout", polls);
+        else if (s->operation == XAI_RAW_GET && s->len > 0)
+            fprintf(stdout, "%s\n", match ? "match" : "mismatch");
+        else
+            fprintf(stdout, "ok\n");
+
+        if (!match)
+            mismatches++;
+        if (ctx->usb_debug && s->operation != XAI_RAW_DELAY)
+            xai_device_packet_print(stderr, packet,
+                    s->operation == XAI_RAW_SET);
+    }
+
+    fprintf(stdout, "%d/%d step(s), %lu transfer(s), %d mismatch(es), "
+            "%llu us\n", i, count, transfers, mismatches,
+            xai_time_us() - start);
+
+    if (ret == RET_OK && mismatches > 0)
+        ret = RET_ERROR_VERIFY;
+    return ret;
+}
+
+
+/*
+ * Host-side profile bank: named profiles, as raw settings parts (same
+ * layout as SET_PROFILE_SETTINGS payloads) and name, one file each in
+ * $XDG_DATA_HOME/xaictl/bank (~/.local/share/xaictl/bank). Loading one
+ * into a slot only writes the parts (and name) that differ from it.
+ */
+
+/*
+ * \param[in] name Entry name, NULL for bank directory
+ * \param[in] create Create missing directories
+ */
+static int xai_bank_path (const char *name, char *path, size_t len,
+        int create)
+{
+    const char *base = getenv("XDG_DATA_HOME"), *home = getenv("HOME");
+    char *p;
+    int n, i;
+
+    if (name != NULL) {
+        n = strlen(name);
+        for (i = 0; i < n; i++)
+            if (!isalnum((unsigned char)name[i]) &&
+                    strchr("._-", name[i]) == NULL)
+                break;
+        if (n == 0 || n > XAI_BANK_NAME_MAX || i < n || name[0] == '.')
+            return RET_ERROR_WRONG_PARAMETER;
+    }
+
+    if (base != NULL && base[0] == '/')
+        n = snprintf(path, len, "%s/%s/bank", base, XAI_MOUSE_PROGRAM_NAME);
+    else if (home != NULL)
+        n = snprintf(path, len, "%s/.local/share/%s/bank", home,
+                XAI_MOUSE_PROGRAM_NAME);
+    else
+        return RET_ERROR_SYSTEM;
+
+    if (n >= (int)len)
+        return RET_ERROR_SYSTEM;
+
+    if (create) {
+        for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+            *p = '\0';
+            mkdir(path, 0700);
+            *p = '/';
+        }
+        if (mkdir(path, 0700) < 0 && errno != EEXIST)
+            return RET_ERROR_SYSTEM;
+    }
+
+    if (name != NULL &&
+            snprintf(path + n, len - n, "/%s", name) >= (int)(len - n))
+        return RET_ERROR_SYSTEM;
+
+    return RET_OK;
+}
+
+static int xai_bank_read (const char *name, struct xai_bank_file *b)
+{
+    char path[256];
+    int fd, ret = RET_OK;
+
+    if ((ret = xai_bank_path(name, path, sizeof(path), 0)) != RET_OK)
+        return ret;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return RET_ERROR_SYSTEM;
+
+    if (read(fd, b, sizeof(*b)) != sizeof(*b) || b->magic != XAI_BANK_MAGIC)
+        ret = RET_ERROR_WRONG_PARAMETER;
+
+    close(fd);
+    b->name[XAI_MOUSE_LL_DATA_LENGTH - 1] = '\0';
+    return ret;
+}
+
+static int xai_bank_list (FILE *out)
+{
+    struct xai_bank_file b;
+    struct xai_profile p;
+    struct xai_ll_message msg;
+    struct dirent *e;
+    char path[256];
+    DIR *dir;
+    int part;
+
+    if (xai_bank_path(NULL, path, sizeof(path), 0) != RET_OK ||
+            (dir = opendir(path)) == NULL)
+        return RET_OK;
+
+    while ((e = readdir(dir)) != NULL) {
+        if (e->d_name[0] == '.' || xai_bank_read(e->d_name, &b) != RET_OK)
+            continue;
+
+        memset(&p, 0, sizeof(struct xai_profile));
+        for (part = 1; part <= 3; part++) {
+            memcpy(msg.u.data, b.parts[part - 1], XAI_MOUSE_LL_DATA_LENGTH);
+            xai_profile_decode_part(&p, part, &msg);
+        }
+        fprintf(out, "%-20s %-16s CPI %d/%d, %d Hz\n", e->d_name, b.name,
+                p.cpi[0], p.cpi[1], p.rate);
+    }
+
+    closedir(dir);
+    return RET_OK;
+}
+
+/*
+ * Store a slot into the bank, reading only what is not known yet.
+ * \param[in] index 0-based profile number
+ */
+static int xai_bank_save (struct xai_context *ctx, const char *name,
+        int index)
+{
+    struct xai_bank_file b;
+    struct xai_plan plan;
+    char path[256], tmp[264];
+    int fd, part, ret;
+
+    if ((ret = xai_bank_path(name, path, sizeof(path), 1)) != RET_OK) {
+        fprintf(stderr, "%s: invalid bank entry name (%s)\n",
+                XAI_MOUSE_PROGRAM_NAME, name);
+        return ret;
+    }
+
+    plan.count = 0;
+    plan.overflow = 0;
+    plan.targets = 0;
+    if (!ctx->p_valid)
+        xai_plan_add(&plan, XAI_MOUSE_LL_HANDSHAKE, 0, 0, 0, NULL);
+    for (part = 1; part <= 3; part++)
+        if (!(ctx->raw_valid[index] & (1 << (part - 1))))
+            xai_plan_add(&plan, XAI_MOUSE_LL_GET_PROFILE_SETTINGS, part, index,
+                    0, NULL);
+    if (!ctx->p_valid)
+        xai_plan_add(&plan, XAI_MOUSE_LL_GET_PROFILE_NAME, 0, index, 0, NULL);
+
+    if ((ret = xai_plan_run(ctx, &plan)) != RET_OK)
+        return ret;
+
+    memset(&b, 0, sizeof(b));
+    b.magic = XAI_BANK_MAGIC;
+    snprintf(b.name, sizeof(b.name), "%.*s", (int)(sizeof(b.name) - 1),
+            ctx->p[index].name);
+    memcpy(b.parts, ctx->raw[index], sizeof(b.parts));
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, &b, sizeof(b)) != sizeof(b) || fsync(fd) < 0 ||
+            rename(tmp, path) < 0) {
+        fprintf(stderr, "%s: can't write %s (%s)\n", XAI_MOUSE_PROGRAM_NAME,
+                path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        unlink(tmp);
+        return RET_ERROR_SYSTEM;
+    }
+
+    close(fd);
+    return RET_OK;
+}
+
+/*
+ * Load a bank entry into a slot: parts and name are compared with the
+ * slot content (read first if not known), only the ones differing are
+ * written. Current profile is set with --current, or reloaded if it is
+ * the modified slot.
+ * \param[in] index 0-based profile number
+ * \return Number of messages sent (0: up to date), or error code
+ */
+static int xai_bank_load (struct xai_context *ctx, const char *name,
+        int index, FILE *out)
+{
+    static struct xai_bank_file b;
+    static struct xai_profile p;
+    struct xai_plan plan;
+    int part, ret;
+
+    if (xai_bank_read(name, &b) != RET_OK) {
+        fprintf(stderr, "%s: can't read bank entry %s\n",
+                XAI_MOUSE_PROGRAM_NAME, name);
+        return RET_ERROR_WRONG_PARAMETER;
+    }
+
+    memset(&p, 0, sizeof(struct xai_profile));
+    snprintf(p.name, sizeof(p.name), "%.*s", (int)(sizeof(b.name) - 1),
+            b.name);
+    p.fields = PROFILE_FIELD_NAME;
+
+    plan.count = 0;
+    plan.overflow = 0;
+    plan.targets = 1 << index;
+
+    if (!ctx->p_valid)
+        xai_plan_add(&plan, XAI_MOUSE_LL_HANDSHAKE, 0, 0, 0, NULL);
+    if (!ctx->p_valid && !ctx->set_current_profile)
+        xai_plan_add(&plan, XAI_MOUSE_LL_GET_CURRENT_PROFILE, 0, 0, 0, NULL);
+    for (part = 1; part <= 3; part++)
+        if (!(ctx->raw_valid[index] & (1 << (part - 1))))
+            xai_plan_add(&plan, XAI_MOUSE_LL_GET_PROFILE_SETTINGS, part, index,
+                    0, NULL);
+    if (!ctx->p_valid)
+        xai_plan_add(&plan, XAI_MOUSE_LL_GET_PROFILE_NAME, 0, index, 0, NULL);
+
+    for (part = 1; part <= 3; part++) {
+        xai_plan_add(&plan, XAI_MOUSE_LL_SET_PROFILE_SETTINGS, part, index,
+                XAI_PLAN_IF_DIFFERS, NULL);
+        plan.steps[plan.count - 1].data = b.parts[part - 1];
+    }
+
+    if (ctx->set_current_profile)
+        xai_plan_add(&plan, XAI_MOUSE_LL_SET_CURRENT_PROFILE, 0, index, 0,
+                NULL);
+    else if (!ctx->p_valid)
+        xai_plan_add(&plan, XAI_MOUSE_LL_SET_CURRENT_PROFILE, 0, 0,
+                XAI_PLAN_IF_CURRENT | XAI_PLAN_IF_WRITTEN, NULL);
+    else if (ctx->cur_index == index)
+        xai_plan_add(&plan, XAI_MOUSE_LL_SET_CURRENT_PROFILE, 0, index,
+                XAI_PLAN_IF_WRITTEN, NULL);
+
+    xai_plan_add(&plan, XAI_MOUSE_LL_SET_PROFILE_NAME, 0, index,
+            XAI_PLAN_IF_DIFFERS, &p);
+
+    if (!ctx->no_flash)
+        xai_plan_add(&plan, XAI_MOUSE_LL_SAVE_TO_FLASH, 0, 0, 0, NULL);
+
+    if (ctx->dry_run) {
+        xai_plan_print(out, &plan);
+        return RET_OK;
+    }
+
+    if ((ret = xai_plan_run(ctx, &plan)) != RET_OK)
+        return ret;
+
+    if (ctx->set_current_profile)
+        ctx->cur_index = (unsigned char)index;
+
+    if (plan.sent == 0)
+        fprintf(out, "profile %d: up to date\n", index + 1);
+    else
+        fprintf(out, "profile %d: %d request(s) sent\n", index + 1,
+                plan.sent);
+
+    return plan.sent;
+}
+
+
+/*
+ * Command interpreter, one command per line (used by --daemon, --shell):
+ *   show LIST                print profiles (from memory)
+ *   set LIST key=value ...   queue changes (keys as for --live)
+ *   switch N                 make profile N current
+ *   status [name]            print current profile number (and name)
+ *   flush                    send queued changes and save to flash
+ *   stats                    print transfer and session counters
+ *   help
+ * LIST is a profile list (2, 1,3-5 or all). Queued changes are sent to
+ * RAM, as one batch, before next command that isn't "set".
+ */
+static const char *xai_field_name (unsigned long field)
+{
+    int i;
+
+    for (i = 0; field_names[i].name != NULL; i++)
+        if (field_names[i].field == field)
+            return field_names[i].name;
+
+    return NULL;
+}
+
+/*
+ * Queue "key=value" changes. A word without '=' belongs to previous value
+ * ("name=My Game c1=800"). Nothing is queued if a change is invalid.
+ */
+static int xai_session_change (struct xai_session *sess, unsigned int targets,
+        char *args, FILE *out)
+{
+    struct xai_profile next[XAI_MOUSE_PROFILE_NUM], tmp;
+    char change[XAI_SESSION_LINE_MAX], buf[XAI_SESSION_LINE_MAX];
+    char *word, *save = NULL;
+    int i, len = 0, ret = RET_OK;
+
+    memcpy(next, sess->pending, sizeof(next));
+
+    change[0] = '\0';
+    word = strtok_r(args, " \t\r\n", &save);
+
+    while (ret == RET_OK) {
+        if (word != NULL && (len == 0 || strchr(word, '=') == NULL)) {
+            len += snprintf(change + len, sizeof(change) - len, "%s%s",
+                    (len == 0) ? "" : " ", word);
+            if (len >= (int)sizeof(change))
+                ret = RET_ERROR_WRONG_PARAMETER;
+            word = strtok_r(NULL, " \t\r\n", &save);
+            continue;
+        }
+
+        if (len == 0)
+            break;
+
+        for (i = 0; i < XAI_MOUSE_PROFILE_NUM && ret == RET_OK; i++) {
+            if (!(targets & (1 << i)))
+                continue;
+            tmp = next[i];
+            tmp.fields = 0;
+            strcpy(buf, change);
+            if (xai_profile_change_line(&tmp, buf) != RET_OK ||
+                    (tmp.fields & ~PROFILE_FIELD_MASK) == 0) {
+                fprintf(out, "error: invalid change (%s)\n", change);
+                ret = RET_ERROR_WRONG_PARAMETER;
+            } else {
+                tmp.fields |= next[i].fields;
+                next[i] = tmp;
             }
+        }
+        len = 0;
+    }
+
+    if (ret == RET_OK)
+        memcpy(sess->pending, next, sizeof(next));
+
+    return ret;
+}
+
+/* Send queued changes to RAM (one batch, no flash commit) */
+static int xai_session_commit (struct xai_context *ctx,
+        struct xai_session *sess)
+{
+    struct xai_profile *changes[XAI_MOUSE_PROFILE_NUM];
+    struct xai_plan plan;
+    int i, n = 0, no_flash = ctx->no_flash, ret;
+
+    for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++) {
+        changes[i] = NULL;
+        if ((sess->pending[i].fields & ~PROFILE_FIELD_MASK) != 0) {
+            changes[i] = &sess->pending[i];
+            n++;
+        }
+    }
+
+    if (n == 0)
+        return RET_OK;
+
+    ctx->no_flash = 1;
+    xai_plan_build_each(ctx, changes, &plan);
+    ret = xai_plan_run(ctx, &plan);
+    ctx->no_flash = no_flash;
+
+    memset(sess->pending, 0, sizeof(sess->pending));
+    if (ret == RET_OK) {
+        sess->dirty = 1;
+        sess->changed_at = xai_time_us();
+        sess->batches++;
+    }
+
+    return ret;
+}
+
+/* Send queued changes, save to flash (unless --no-flash) */
+static int xai_session_flush (struct xai_context *ctx,
+        struct xai_session *sess)
+{
+    int ret;
+
+    if ((ret = xai_session_commit(ctx, sess)) != RET_OK)
+        return ret;
+
+    if (sess->dirty && !ctx->no_flash) {
+        if ((ret = xai_device_write_to_flash(ctx)) != RET_OK)
+            return ret;
+        sess->commits++;
+    }
+
+    sess->dirty = 0;
+    return RET_OK;
+}
+
+static int xai_session_exec (struct xai_context *ctx, struct xai_session *sess,
+        char *line, FILE *out)
+{
+    char *cmd, *arg, *save = NULL, *word;
+    unsigned int targets = 0;
+    int i = 0, ret, no_flash;
+
+    cmd = strtok_r(line, " \t\r\n", &save);
+    if (cmd == NULL || *cmd == '#')
+        return RET_OK;
+
+    sess->commands++;
+    arg = strtok_r(NULL, " \t\r\n", &save);
+
+    if ((strcmp(cmd, "show") == 0 || strcmp(cmd, "set") == 0 ||
+                strcmp(cmd, "switch") == 0) &&
+            (arg == NULL || xai_profile_list_parse(arg, &targets) != RET_OK)) {
+        fprintf(out, "error: invalid profile number (%s)\n",
+                arg ? arg : "missing");
+        return RET_ERROR_WRONG_PARAMETER;
+    }
+
+    if (strcmp(cmd, "set") == 0)
+        return xai_session_change(sess, targets, save, out);
+
+    /* Bank commands: save NAME N, load NAME N [current] */
+    if (strcmp(cmd, "save") == 0 || strcmp(cmd, "load") == 0) {
+        word = strtok_r(NULL, " \t\r\n", &save);
+        if (arg == NULL || word == NULL ||
+                xai_profile_list_parse(word, &targets) != RET_OK ||
+                (targets & (targets - 1))) {
+            fprintf(out, "error: usage: %s NAME N\n", cmd);
+            return RET_ERROR_WRONG_PARAMETER;
+        }
+        for (i = 0; !(targets & (1 << i)); )
+            i++;
+    }
+
+    /* Other commands see queued changes */
+    if ((ret = xai_session_commit(ctx, sess)) != RET_OK) {
+        fprintf(out, "error: changes not applied (%d)\n", ret);
+        return ret;
+    }
+
+    if (strcmp(cmd, "show") == 0) {
+        for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++)
+            if (targets & (1 << i))
+                xai_profile_print(out, &ctx->p[i], i == ctx->cur_index);
+
+    } else if (strcmp(cmd, "switch") == 0) {
+        if (targets & (targets - 1)) {
+            fprintf(out, "error: switch needs a single profile number\n");
+            return RET_ERROR_WRONG_PARAMETER;
+        }
+        for (i = 0; !(targets & (1 << i)); )
+            i++;
+        if ((ret = xai_profile_set_current_index(ctx, i)) != RET_OK) {
+            fprintf(out, "error: can't switch profile (%d)\n", ret);
+            return ret;
+        }
+        ctx->cur_index = (unsigned char)i;
+        sess->dirty = 1;
+        sess->changed_at = xai_time_us();
+
+    } else if (strcmp(cmd, "status") == 0) {
+        xai_device_status_print(out, ctx, arg != NULL &&
+                strcmp(arg, "name") == 0);
+
+    } else if (strcmp(cmd, "save") == 0) {
+        if ((ret = xai_bank_save(ctx, arg, i)) != RET_OK) {
+            fprintf(out, "error: can't save to bank (%d)\n", ret);
+            return ret;
+        }
+
+    } else if (strcmp(cmd, "load") == 0) {
+        word = strtok_r(NULL, " \t\r\n", &save);
+        ctx->set_current_profile = (word != NULL &&
+                strcmp(word, "current") == 0);
+        no_flash = ctx->no_flash;
+        ctx->no_flash = 1;
+        ret = xai_bank_load(ctx, arg, i, out);
+        ctx->no_flash = no_flash;
+        ctx->set_current_profile = 0;
+        if (ret < 0) {
+            fprintf(out, "error: can't load from bank (%d)\n", ret);
+            return ret;
+        }
+        if (ret > 0) {
+            sess->dirty = 1;
+            sess->changed_at = xai_time_us();
+            sess->batches++;
+        }
+
+    } else if (strcmp(cmd, "flush") == 0) {
+        if ((ret = xai_session_flush(ctx, sess)) != RET_OK) {
+            fprintf(out, "error: can't save to flash (%d)\n", ret);
+            return ret;
+        }
+
+    } else if (strcmp(cmd, "stats") == 0) {
+        fprintf(out, "transfers       : %lu (%lu retries)\n"
+                "failures        : %lu bus, %lu no answer, %lu bad id, "
+                "%lu mismatch\n"
+                "commands        : %lu\n"
+                "batches sent    : %lu\n"
+                "flash commits   : %lu%s\n",
+                ctx->stats.transfers, ctx->stats.retries,
+                ctx->stats.failures[XAI_FAIL_BUS],
+                ctx->stats.failures[XAI_FAIL_NO_PONG],
+                ctx->stats.failures[XAI_FAIL_BAD_ID],
+                ctx->stats.failures[XAI_FAIL_MISMATCH],
+                sess->commands, sess->batches, sess->commits,
+                sess->dirty ? " (changes not saved yet)" : "");
+
+    } else if (strcmp(cmd, "help") == 0) {
+        fprintf(out, "show LIST, set LIST key=value..., switch N, "
+                "status [name], save NAME N, load NAME N [current], flush, "
+                "stats\n");
+
+    } else {
+        fprintf(out, "error: unknown command (%s)\n", cmd);
+        return RET_ERROR_WRONG_PARAMETER;
+    }
+
+    return RET_OK;
+}
+
+
+/*
+ * Interactive shell (--shell): commands of xai_session_exec read from
+ * standard input, on the session opened once. Each line is sent to RAM
+ * as soon as it is entered; flash commit is done on exit ("quit", end of
+ * input, SIGINT or SIGTERM), or by "flush".
+ */
+static int xai_shell_run (struct xai_context *ctx)
+{
+    static struct xai_session sess;
+    char line[XAI_SESSION_LINE_MAX];
+    struct sigaction sa;
+    int tty = isatty(STDIN_FILENO), ret;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = xai_live_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!live_stop) {
+        if (tty) {
+            fprintf(stdout, "xai> ");
+            fflush(stdout);
+        }
+
+        if (fgets(line, sizeof(line), stdin) == NULL)
             break;
-        case PROFILE_FIELD_BUTTON_9:
-            if (button_setup_parse((const char *)arg, &p->button[8])
-                    == RET_OK) {
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid function name for button %d, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, 9);
+        if (strncmp(line, "quit", 4) == 0 || strncmp(line, "exit", 4) == 0)
+            break;
+
+        xai_session_exec(ctx, &sess, line, stdout);
+
+        if ((ret = xai_session_commit(ctx, &sess)) != RET_OK)
+            fprintf(stdout, "error: changes not applied (%d)\n", ret);
+        fflush(stdout);
+    }
+
+    if (tty)
+        fprintf(stdout, "\n");
+
+    if ((ret = xai_session_flush(ctx, &sess)) != RET_OK)
+        fprintf(stderr, "%s: error in xai_session_flush (%d)\n",
+                XAI_MOUSE_PROGRAM_NAME, ret);
+
+    return ret;
+}
+
+
+/*
+ * On-demand daemon (--daemon): keeps the device claimed and its state
+ * decoded, and serves requests forwarded by xaictl invocations through a
+ * unix socket (systemd socket activation, or XAI_DAEMON_SOCKET). A request
+ * is a list of commands (see xai_session_exec); each command answer ends
+ * with a line "OK" or "ERR code". Flash commit is deferred like --live.
+ * After --idle-timeout seconds without request, or on a "release" request
+ * (sent by invocations that are not forwarded, before they take the
+ * device lock), the device is released (kernel driver reattached) and the
+ * daemon exits. While it serves, its pid is in XAI_DAEMON_PID_FILE: other
+ * invocations check it (see xai_daemon_running) instead of connecting,
+ * which would start a daemon through socket activation.
+ */
+
+/*
+ * \param[out] created Socket file has been created (not inherited)
+ * \return Listening socket, -1 on error
+ */
+static int xai_daemon_listen (int *created)
+{
+    struct sockaddr_un addr;
+    const char *env;
+    int fd;
+
+    *created = 0;
+
+    /* sd_listen_fds(3) protocol, first descriptor is 3 */
+    env = getenv("LISTEN_PID");
+    if (env != NULL && atoi(env) == (int)getpid()) {
+        env = getenv("LISTEN_FDS");
+        if (env != NULL && atoi(env) >= 1) {
+            fcntl(3, F_SETFD, FD_CLOEXEC);
+            return 3;
+        }
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, XAI_DAEMON_SOCKET, sizeof(addr.sun_path) - 1);
+    unlink(XAI_DAEMON_SOCKET);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    chmod(XAI_DAEMON_SOCKET, 0660);
+    *created = 1;
+    return fd;
+}
+
+/*
+ * One request (until client shuts down writing)
+ * \return 1 if device must be released
+ */
+static int xai_daemon_serve (struct xai_context *ctx,
+        struct xai_session *sess, int fd)
+{
+    char line[XAI_SESSION_LINE_MAX];
+    struct timeval tv;
+    FILE *in, *out;
+    int ret, out_fd, release = 0;
+
+    tv.tv_sec = XAI_DAEMON_RCV_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    out_fd = dup(fd);
+    in = fdopen(fd, "r");
+    out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+    if (in == NULL || out == NULL) {
+        if (in != NULL)
+            fclose(in);
+        else
+            close(fd);
+        if (out != NULL)
+            fclose(out);
+        else if (out_fd >= 0)
+            close(out_fd);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        /* Answered once changes are saved, device is free soon after */
+        if (strncmp(line, "release", 7) == 0) {
+            ret = xai_session_flush(ctx, sess);
+            release = 1;
+        } else {
+            ret = xai_session_exec(ctx, sess, line, out);
+        }
+        if (ret == RET_OK)
+            fprintf(out, "OK\n");
+        else
+            fprintf(out, "ERR %d\n", ret);
+    }
+
+    /* Changes of this request are in RAM before answer is complete */
+    if ((ret = xai_session_commit(ctx, sess)) != RET_OK)
+        fprintf(out, "error: changes not applied (%d)\nERR %d\n", ret, ret);
+
+    fclose(out);
+    fclose(in);
+    return release;
+}
+
+/*
+ * Device session must be open (and state read). Stops when idle, or on
+ * SIGINT or SIGTERM. Changes not saved yet are saved before return.
+ */
+static int xai_daemon_run (struct xai_context *ctx)
+{
+    static struct xai_session sess;
+    unsigned long long now, last, deadline;
+    struct sigaction sa;
+    struct pollfd pfd;
+    char pid[16];
+    int fd, n, created, pid_fd, pid_written, ret = RET_OK;
+
+    if ((fd = xai_daemon_listen(&created)) < 0) {
+        fprintf(stderr, "%s: can't listen on %s (%s)\n",
+                XAI_MOUSE_PROGRAM_NAME, XAI_DAEMON_SOCKET, strerror(errno));
+        return RET_ERROR_SYSTEM;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = xai_live_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    snprintf(pid, sizeof(pid), "%d\n", (int)getpid());
+    pid_fd = open(XAI_DAEMON_PID_FILE, O_WRONLY | O_CREAT | O_TRUNC |
+            O_NOFOLLOW | O_CLOEXEC, 0644);
+    pid_written = (pid_fd >= 0 &&
+            write(pid_fd, pid, strlen(pid)) == (ssize_t)strlen(pid));
+    if (pid_fd >= 0)
+        close(pid_fd);
+    if (!pid_written) {
+        if (pid_fd >= 0)
+            unlink(XAI_DAEMON_PID_FILE);
+        fprintf(stderr, "%s: can't write %s, other modes won't release "
+                "the device\n", XAI_MOUSE_PROGRAM_NAME, XAI_DAEMON_PID_FILE);
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    last = xai_time_us();
+
+    while (!live_stop) {
+        now = xai_time_us();
+        deadline = last + ctx->idle_timeout * 1000000ULL;
+        if (sess.dirty && !ctx->no_flash &&
+                sess.changed_at + ctx->flash_delay * 1000ULL < deadline)
+            deadline = sess.changed_at + ctx->flash_delay * 1000ULL;
+
+        n = poll(&pfd, 1, (deadline > now) ?
+                (int)((deadline - now + 999) / 1000) : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = RET_ERROR_SYSTEM;
+            break;
+        }
+
+        if (n == 0) {
+            now = xai_time_us();
+            if (sess.dirty && !ctx->no_flash &&
+                    now >= sess.changed_at + ctx->flash_delay * 1000ULL) {
+                if ((ret = xai_session_flush(ctx, &sess)) != RET_OK)
+                    fprintf(stderr, "%s: error in xai_session_flush (%d)\n",
+                            XAI_MOUSE_PROGRAM_NAME, ret);
+                sess.dirty = 0;
+            } else if (now >= last + ctx->idle_timeout * 1000000ULL) {
+                break;
             }
+            continue;
+        }
+
+        if ((n = accept(fd, NULL, NULL)) < 0)
+            continue;
+
+        if (xai_daemon_serve(ctx, &sess, n))
             break;
+        last = xai_time_us();
+    }
+
+    if (sess.dirty && (ret = xai_session_flush(ctx, &sess)) != RET_OK)
+        fprintf(stderr, "%s: error in xai_session_flush (%d)\n",
+                XAI_MOUSE_PROGRAM_NAME, ret);
+
+    if (pid_written)
+        unlink(XAI_DAEMON_PID_FILE);
+    close(fd);
+    if (created)
+        unlink(XAI_DAEMON_SOCKET);
+
+    if (ctx->usb_debug)
+        fprintf(stderr, "%s: %lu command(s), %lu batch(es) sent, %lu flash "
+                "commit(s)\n", XAI_MOUSE_PROGRAM_NAME, sess.commands,
+                sess.batches, sess.commits);
+
+    return ret;
+}
+
+/* \return 1 if a daemon holds the device (state read, serving) */
+static int xai_daemon_running (void)
+{
+    char buf[32], comm[32];
+    FILE *f;
+    int pid = 0;
+
+    if ((f = fopen(XAI_DAEMON_PID_FILE, "r")) != NULL) {
+        if (fscanf(f, "%d", &pid) != 1)
+            pid = 0;
+        fclose(f);
+    }
+
+    if (pid <= 0 || (kill(pid, 0) < 0 && errno != EPERM))
+        return 0;
+
+    /* stale file, pid reused */
+    snprintf(buf, sizeof(buf), "/proc/%d/comm", pid);
+    if ((f = fopen(buf, "r")) == NULL)
+        return 0;
+    if (fgets(comm, sizeof(comm), f) == NULL)
+        comm[0] = '\0';
+    fclose(f);
+
+    return strcmp(comm, XAI_MOUSE_PROGRAM_NAME "\n") == 0;
+}
+
+/*
+ * Connect to the daemon socket. With socket activation, this starts the
+ * daemon if it is not running.
+ * \return Connected socket, -1 if no daemon is listening
+ */
+static int xai_client_connect (void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, XAI_DAEMON_SOCKET, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Send a request to the daemon, print its answer.
+ * \param[out] answers Number of command answers, 0: request not served
+ *             (daemon failed to start, no device, or timeout)
+ * \return RET_OK if every command succeeded
+ */
+static int xai_client_request (int fd, const char *request, int *answers)
+{
+    char line[XAI_SESSION_LINE_MAX];
+    size_t len = strlen(request);
+    struct timeval tv;
+    ssize_t n;
+    FILE *in;
+    int ret = RET_OK;
+
+    *answers = 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    tv.tv_sec = XAI_CLIENT_RCV_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (len > 0) {
+        if ((n = write(fd, request, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return RET_ERROR_SYSTEM;
+        }
+        request += n;
+        len -= (size_t)n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    if ((in = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return RET_ERROR_SYSTEM;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (strcmp(line, "OK\n") == 0) {
+            (*answers)++;
+        } else if (strncmp(line, "ERR ", 4) == 0) {
+            (*answers)++;
+            ret = atoi(line + 4);
+        } else if (strncmp(line, "error: ", 7) == 0) {
+            fprintf(stderr, "%s: %s", XAI_MOUSE_PROGRAM_NAME, line + 7);
+        } else {
+            fputs(line, stdout);
+        }
+    }
+
+    fclose(in);
+
+    return (*answers > 0) ? ret : RET_ERROR_SYSTEM;
+}
+
+
+/*
+ * Soak test (--soak=N): repeat read-all / write part / verify / switch
+ * (/ flash) cycles and report latency percentiles and failure classes
+ * per operation.
+ */
+#define XAI_SOAK_READ_ALL             0
+#define XAI_SOAK_WRITE                1
+#define XAI_SOAK_VERIFY               2
+#define XAI_SOAK_SWITCH               3
+#define XAI_SOAK_FLASH                4
+#define XAI_SOAK_OP_NUM               5
+
+static const char *soak_op_names[XAI_SOAK_OP_NUM] = {
+    "read-all", "write", "verify", "switch", "flash"
+};
+
+struct xai_soak_op
+{
+    unsigned long *samples;      /* latency, microseconds */
+    unsigned long count;
+    unsigned long failed;
+    unsigned long failures[XAI_FAIL_NUM];
+};
+
+static int xai_soak_compare (const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile, samples must be sorted */
+static unsigned long xai_soak_percentile (unsigned long *samples,
+        unsigned long n, int pct)
+{
+    unsigned long rank;
+
+    if (n == 0)
+        return 0;
+
+    rank = (n * pct + 99) / 100;
+    return samples[(rank > 0) ? rank - 1 : 0];
+}
+
+static void xai_soak_record (struct xai_context *ctx, struct xai_soak_op *op,
+        unsigned long long start, struct xai_stats *before, int ret)
+{
+    unsigned long d;
+    int i;
 
-        case PROFILE_FIELD_CPI1:
-            n = strtoul(arg, NULL, 10);
-            if (n >= XAI_MOUSE_CPI_MIN && n <= XAI_MOUSE_CPI_MAX) {
-                p->cpi[0] = (unsigned short)n;
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, "cpi1");
-            }
-            break;
+    op->samples[op->count++] = (unsigned long)(xai_time_us() - start);
 
-        case PROFILE_FIELD_CPI2:
-            n = strtoul(arg, NULL, 10);
-            if (n >= XAI_MOUSE_CPI_MIN && n <= XAI_MOUSE_CPI_MAX) {
-                p->cpi[1] = (unsigned short)n;
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, "cpi2");
-            }
-            break;
+    /* failure classes are counted even if operation recovered */
+    for (i = 0; i < XAI_FAIL_NUM; i++) {
+        d = ctx->stats.failures[i] - before->failures[i];
+        op->failures[i] += d;
+    }
 
-        case PROFILE_FIELD_RATE:
-            n = strtoul(arg, NULL, 10);
-            if (n >= XAI_MOUSE_RATE_MIN && n <= XAI_MOUSE_RATE_MAX) {
-                p->rate = (short)n;
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, "rate");
-            }
-            break;
+    if (ret != RET_OK)
+        op->failed++;
+}
 
-        case PROFILE_FIELD_ACCEL:
-            n = strtoul(arg, NULL, 10);
-            if (n >= XAI_MOUSE_ACCEL_MIN && n <= XAI_MOUSE_ACCEL_MAX) {
-                p->accel = (short)n;
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, "accel");
-            }
-            break;
+static int xai_soak_run (struct xai_context *ctx, int index, int cycles)
+{
+    struct xai_soak_op ops[XAI_SOAK_OP_NUM];
+    struct xai_stats before;
+    struct xai_profile change, readback;
+    unsigned long long start, t;
+    unsigned long transfers, retries, total_failed = 0;
+    short brightness[2];
+    int orig_index, i, n, ret;
+
+    memset(ops, 0, sizeof(ops));
+    for (i = 0; i < XAI_SOAK_OP_NUM; i++) {
+        ops[i].samples = (unsigned long *)calloc(cycles, sizeof(unsigned long));
+        if (ops[i].samples == NULL) {
+            while (i--)
+                free(ops[i].samples);
+            return RET_ERROR_SYSTEM;
+        }
+    }
 
-        case PROFILE_FIELD_FREEMOVE:
-            n = strtoul(arg, NULL, 10);
-            if (n >= XAI_MOUSE_FREEMOVE_MIN && n <= XAI_MOUSE_FREEMOVE_MAX) {
-                p->freemove = (short)(0x64 + n * 5);
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, "freemove");
-            }
-            break;
+    /* alternate LCD brightness and current profile, restored at end */
+    orig_index = ctx->cur_index;
+    brightness[0] = ctx->p[index].lcd_brightness;
+    brightness[1] = (brightness[0] % XAI_MOUSE_LCD_BRIGHTNESS_MAX) + 1;
+
+    transfers = ctx->stats.transfers;
+    retries = ctx->stats.retries;
+    start = xai_time_us();
+
+    for (n = 0; n < cycles; n++) {
+        before = ctx->stats;
+        t = xai_time_us();
+        ret = xai_device_init(ctx);
+        xai_soak_record(ctx, &ops[XAI_SOAK_READ_ALL], t, &before, ret);
+
+        memset(&change, 0, sizeof(struct xai_profile));
+        change.fields = PROFILE_FIELD_LCD_BRIGHTNESS;
+        change.lcd_brightness = brightness[(n + 1) & 1];
+
+        before = ctx->stats;
+        t = xai_time_us();
+        ret = xai_profile_set_config(ctx, index, &change);
+        xai_soak_record(ctx, &ops[XAI_SOAK_WRITE], t, &before, ret);
+
+        before = ctx->stats;
+        t = xai_time_us();
+        memset(&readback, 0, sizeof(struct xai_profile));
+        ret = xai_profile_get_config(ctx, index, &readback);
+        if (ret == RET_OK && readback.lcd_brightness != change.lcd_brightness) {
+            ctx->stats.failures[XAI_FAIL_MISMATCH]++;
+            ret = RET_ERROR_VERIFY;
+        }
+        xai_soak_record(ctx, &ops[XAI_SOAK_VERIFY], t, &before, ret);
+
+        before = ctx->stats;
+        t = xai_time_us();
+        ret = xai_profile_set_current_index(ctx, (n & 1) ? orig_index :
+                (orig_index + 1) % XAI_MOUSE_PROFILE_NUM);
+        xai_soak_record(ctx, &ops[XAI_SOAK_SWITCH], t, &before, ret);
+
+        if (!ctx->no_flash) {
+            before = ctx->stats;
+            t = xai_time_us();
+            ret = xai_device_write_to_flash(ctx);
+            xai_soak_record(ctx, &ops[XAI_SOAK_FLASH], t, &before, ret);
+        }
+    }
 
-        case PROFILE_FIELD_AIM:
-            n = strtoul(arg, NULL, 10);
-            if (n >= XAI_MOUSE_AIM_MIN && n <= XAI_MOUSE_AIM_MAX) {
-                p->aim = (short)(0x64 + n * 5);
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, "aim");
-            }
+    t = xai_time_us() - start;
+    transfers = ctx->stats.transfers - transfers;
+
+    /* restore initial state */
+    if (cycles & 1) {
+        memset(&change, 0, sizeof(struct xai_profile));
+        change.fields = PROFILE_FIELD_LCD_BRIGHTNESS;
+        change.lcd_brightness = brightness[0];
+        xai_profile_set_config(ctx, index, &change);
+        xai_profile_set_current_index(ctx, orig_index);
+        if (!ctx->no_flash)
+            xai_device_write_to_flash(ctx);
+    }
+
+    fprintf(stdout, "Soak test: %d cycles, %lu transfers in %.2f s "
+            "(%.1f cycles/s, %.1f transfers/s)\n", cycles, transfers,
+            t / 1e6, cycles * 1e6 / (t ? t : 1), transfers * 1e6 / (t ? t : 1));
+    fprintf(stdout, "Answers polled again: %lu\n", ctx->stats.retries - retries);
+    fprintf(stdout, "Flash commits: %s\n", ctx->no_flash ? "skipped" : "done");
+    if (ctx->wake_us)
+        fprintf(stdout, "Wake-up (runtime resume): %.2f ms, not included below\n",
+                ctx->wake_us / 1000.0);
+    fputc('\n', stdout);
+    fprintf(stdout, "operation  count   failed   p50 ms   p99 ms   max ms"
+            "    bus  no-pong  bad-id  mismatch\n");
+
+    for (i = 0; i < XAI_SOAK_OP_NUM; i++) {
+        struct xai_soak_op *op = &ops[i];
+
+        if (op->count == 0)
+            continue;
+
+        qsort(op->samples, op->count, sizeof(unsigned long), xai_soak_compare);
+        fprintf(stdout, "%-9s %6lu  %6.2f%%  %7.2f  %7.2f  %7.2f  %5lu  %7lu  %6lu  %8lu\n",
+                soak_op_names[i], op->count, op->failed * 100.0 / op->count,
+                xai_soak_percentile(op->samples, op->count, 50) / 1000.0,
+                xai_soak_percentile(op->samples, op->count, 99) / 1000.0,
+                op->samples[op->count - 1] / 1000.0,
+                op->failures[XAI_FAIL_BUS], op->failures[XAI_FAIL_NO_PONG],
+                op->failures[XAI_FAIL_BAD_ID], op->failures[XAI_FAIL_MISMATCH]);
+
+        total_failed += op->failed;
+        free(op->samples);
+    }
+
+    return (total_failed == 0) ? RET_OK : RET_ERROR_VERIFY;
+}
+
+/*
+ * Fleet mode: list all attached mice (bus/address)
+ * Returns number of devices found.
+ */
+static int xai_fleet_enumerate (int vendor_id, int product_id,
+        struct xai_fleet_worker *workers, int max)
+{
+    libusb_context *usb;
+    libusb_device **list;
+    struct libusb_device_descriptor desc;
+    ssize_t i, n;
+    int count = 0;
+
+    if (libusb_init(&usb) < 0)
+        return 0;
+
+    n = libusb_get_device_list(usb, &list);
+    for (i = 0; i < n && count < max; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) != LIBUSB_SUCCESS)
+            continue;
+
+        if (desc.idVendor == vendor_id && desc.idProduct == product_id) {
+            workers[count].bus = libusb_get_bus_number(list[i]);
+            workers[count].address = libusb_get_device_address(list[i]);
+            count++;
+        }
+    }
+
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+    libusb_exit(usb);
+
+    return count;
+}
+
+/*
+ * Fleet mode: thread body, full session on one device
+ */
+static void *xai_fleet_worker_run (void *arg)
+{
+    struct xai_fleet_worker *w = (struct xai_fleet_worker *)arg;
+    unsigned long long start = xai_time_us();
+    int i;
+
+    w->ret = xai_init_device(w->bus, w->address, XAI_MOUSE_INTERFACE_NUM,
+            &w->ctx);
+
+    if (w->ret == RET_COALESCED) {
+        w->ret = RET_OK;
+    } else if (w->ret == RET_OK) {
+        w->ret = xai_journal_recover(&w->ctx);
+        if ((w->ret == RET_OK) && w->ctx.read_only)
+            w->ret = xai_device_init(&w->ctx);
+
+        if ((w->ret == RET_OK) && !w->ctx.read_only) {
+            w->ret = xai_profile_apply(&w->ctx, w->targets, w->changes);
+            for (i = 0; i < XAI_MOUSE_PROFILE_NUM && w->ret == RET_OK; i++)
+                if (w->targets & (1 << i))
+                    w->ret = xai_profile_verify(&w->ctx, i, w->changes);
+        }
+
+        xai_uninit(&w->ctx);
+    }
+
+    w->elapsed_us = xai_time_us() - start;
+    return NULL;
+}
+
+/*
+ * Fleet mode: apply (or print) the same profile on all attached mice.
+ * Devices are handled concurrently, so total time is bounded by the
+ * slowest device (and host controller bandwidth), not by device count.
+ */
+static int xai_fleet_run (struct xai_context *ctx, unsigned int targets,
+        struct xai_profile *newp)
+{
+    static struct xai_fleet_worker workers[XAI_FLEET_MAX];
+    unsigned long long start;
+    int i, j, n, ok = 0;
+    int write_mode = (newp->fields != 0) || (ctx->set_current_profile);
+
+    n = xai_fleet_enumerate(XAI_MOUSE_VENDOR_ID, XAI_MOUSE_PRODUCT_ID,
+            workers, XAI_FLEET_MAX);
+    if (n == 0)
+        return RET_ERROR_NO_DEVICE_FOUND;
+
+    start = xai_time_us();
+
+    for (i = 0; i < n; i++) {
+        workers[i].ctx = *ctx;
+        workers[i].targets = targets;
+        workers[i].changes = newp;
+        workers[i].ret = RET_ERROR_SYSTEM;
+
+        if (pthread_create(&workers[i].thread, NULL, xai_fleet_worker_run,
+                    &workers[i]) != 0) {
+            workers[i].thread = 0;
+            fprintf(stderr, "%s: cannot create thread for device %03d:%03d\n",
+                    XAI_MOUSE_PROGRAM_NAME, workers[i].bus, workers[i].address);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (workers[i].thread != 0)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (workers[i].ret == RET_OK)
+            ok++;
+
+        if (!write_mode && workers[i].ret == RET_OK) {
+            fprintf(stdout, "Device %03d:%03d\n", workers[i].bus,
+                    workers[i].address);
+            for (j = 0; j < XAI_MOUSE_PROFILE_NUM; j++)
+                if (targets & (1 << j))
+                    xai_profile_print(stdout, &workers[i].ctx.p[j],
+                            j == workers[i].ctx.cur_index);
+        } else if (workers[i].ret == RET_OK) {
+            fprintf(stdout, "%03d:%03d  ok      %6llu ms\n", workers[i].bus,
+                    workers[i].address, workers[i].elapsed_us / 1000);
+        } else {
+            fprintf(stdout, "%03d:%03d  failed  %6llu ms (%s%d)\n",
+                    workers[i].bus, workers[i].address,
+                    workers[i].elapsed_us / 1000,
+                    (workers[i].ret == RET_ERROR_VERIFY) ? "verify " : "error ",
+                    workers[i].ret);
+        }
+    }
+
+    fprintf(stdout, "%d/%d device(s) %s in %llu ms\n", ok, n,
+            write_mode ? "configured" : "read",
+            (xai_time_us() - start) / 1000);
+
+    return (ok == n) ? RET_OK : RET_ERROR_BUS;
+}
+
+/*
+ * Fleet status (--all --status): all devices are queried from a single
+ * thread and poll() loop, using asynchronous requests. Each device goes
+ * through handshake, GET_CURRENT_PROFILE and GET_PROFILE_NAME (with
+ * --status=name), at its own pace.
+ */
+static void xai_fleet_status_next (struct xai_context *ctx,
+        struct xai_ll_message *answer, int ret, void *user)
+{
+    struct xai_fleet_worker *w = (struct xai_fleet_worker *)user;
+    struct xai_ll_message req;
+
+    if (ret != RET_OK) {
+        w->ret = ret;
+        return;
+    }
+
+    memset(&req, 0, sizeof(struct xai_ll_message));
+
+    switch (w->step++) {
+        case 0: /* handshake sent */
+            ctx->cur_id = 0x77;
+            req.header.operation = XAI_MOUSE_LL_GET_CURRENT_PROFILE;
             break;
 
-        case PROFILE_FIELD_LCD_BRIGHTNESS:
-            n = strtoul(arg, NULL, 10);
-            if (n >= XAI_MOUSE_LCD_BRIGHTNESS_MIN &&
-                    n <= XAI_MOUSE_LCD_BRIGHTNESS_MAX) {
-                p->lcd_brightness = (short)n;
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, "LCD brightness");
+        case 1:
+            if (answer->header.part >= XAI_MOUSE_PROFILE_NUM) {
+                w->ret = RET_ERROR_BUS;
+                return;
             }
+            ctx->cur_index = answer->header.part;
+            if (ctx->status != 2) {
+                w->ret = RET_OK;
+                return;
+            }
+            req.header.operation = XAI_MOUSE_LL_GET_PROFILE_NAME;
+            req.header.argument1 = ctx->cur_index;
             break;
 
-        case PROFILE_FIELD_LCD_CONTRAST:
-            n = strtoul(arg, NULL, 10);
+        default:
+            snprintf(ctx->p[ctx->cur_index].name, XAI_MOUSE_LL_DATA_LENGTH,
+                    "%.*s", (int)(XAI_MOUSE_LL_DATA_LENGTH - 1),
+                    &answer->u.data[0]);
+            w->ret = RET_OK;
+            return;
+    }
 
-            if (n >= XAI_MOUSE_LCD_CONTRAST_MIN && n <=
-                    XAI_MOUSE_LCD_CONTRAST_MAX) {
-                p->lcd_contrast = (short)n;
-                p->fields |= field;
-            } else {
-                fprintf(stderr, "%s: invalid value for %s, ignoring option\n",
-                        XAI_MOUSE_PROGRAM_NAME, "LCD contrast");
-            }
+    req.header.id = xai_device_next_id(ctx);
+    w->ret = xai_async_submit(ctx, &req, XAI_MOUSE_LL_PONG_OR_RES,
+            xai_fleet_status_next, w);
+    if (w->ret == RET_OK)
+        w->ret = RET_PENDING;
+}
+
+static int xai_fleet_status (struct xai_context *ctx)
+{
+    static struct xai_fleet_worker workers[XAI_FLEET_MAX];
+    struct pollfd fds[XAI_FLEET_MAX * 4];
+    struct xai_ll_message req;
+    struct xai_fleet_worker *w;
+    int i, n, nfds, ms, t, pending, ok = 0;
+
+    n = xai_fleet_enumerate(XAI_MOUSE_VENDOR_ID, XAI_MOUSE_PRODUCT_ID,
+            workers, XAI_FLEET_MAX);
+    if (n == 0)
+        return RET_ERROR_NO_DEVICE_FOUND;
+
+    for (i = 0; i < n; i++) {
+        w = &workers[i];
+        w->ctx = *ctx;
+        w->step = 0;
+        w->ret = xai_init_device(w->bus, w->address, XAI_MOUSE_INTERFACE_NUM,
+                &w->ctx);
+
+        if (w->ret == RET_OK) {
+            memset(&req, 0, sizeof(struct xai_ll_message));
+            memcpy(&req, &init_string[0], sizeof(init_string));
+            w->ret = xai_async_submit(&w->ctx, &req, 0,
+                    xai_fleet_status_next, w);
+            if (w->ret == RET_OK)
+                w->ret = RET_PENDING;
+        } else {
+            w->step = -1; /* not opened */
+            if (w->ret == RET_COALESCED)
+                w->ret = RET_OK; /* answered from published snapshot */
+        }
+    }
+
+    do {
+        pending = 0;
+        nfds = 0;
+        ms = -1;
+
+        for (i = 0; i < n; i++) {
+            w = &workers[i];
+            if (w->ret != RET_PENDING)
+                continue;
+
+            pending++;
+            nfds += xai_async_pollfds(&w->ctx, &fds[nfds],
+                    XAI_FLEET_MAX * 4 - nfds);
+            t = xai_async_next_timeout(&w->ctx);
+            if (t >= 0 && (ms < 0 || t < ms))
+                ms = t;
+        }
+
+        if (pending == 0)
             break;
 
-        case PROFILE_FIELD_NAME:
-            strncpy(&p->name[0], arg, XAI_MOUSE_LL_DATA_LENGTH);
-            p->fields |= field;
+        if (poll(fds, nfds, ms) < 0 && errno != EINTR)
             break;
 
-        default:
-            return RET_ERROR_WRONG_PARAMETER;
+        for (i = 0; i < n; i++) {
+            w = &workers[i];
+            if (w->ret == RET_PENDING &&
+                    xai_async_handle_events(&w->ctx) != RET_OK)
+                w->ret = RET_ERROR_BUS;
+        }
+    } while (1);
+
+    for (i = 0; i < n; i++) {
+        w = &workers[i];
+
+        if (w->ret == RET_OK) {
+            ok++;
+            fprintf(stdout, "%03d:%03d  ", w->bus, w->address);
+            xai_device_status_print(stdout, &w->ctx, ctx->status == 2);
+        } else {
+            fprintf(stdout, "%03d:%03d  failed (error %d)\n", w->bus,
+                    w->address, w->ret);
+        }
+
+        if (w->step >= 0)
+            xai_uninit(&w->ctx);
     }
 
-    return RET_OK;
+    return (ok == n) ? RET_OK : RET_ERROR_BUS;
 }
 
-
 static void version(void)
 {
     fprintf(stdout, "%s %s\n"
@@ -1134,8 +6024,9 @@ static void version(void)
 
 static void help(void)
 {
-    fprintf(stdout, "Usage: %s [options] profile_num\n"
+    fprintf(stdout, "Usage: %s [options] profile_num|list\n"
             "\n"
+            "Profile list: 2, 1,3-5 or all.\n"
             "If no option given, print human readable profile details.\n"
             "Available configuration options:\n"
             "  -c, --c1=VALUE       set CPI1 (%d - %d CPI)\n"
@@ -1159,6 +6050,31 @@ static void help(void)
             "Available global options:\n"
             "      --debug          debug mode (show usb frames data)\n"
             "      --rebind         rebind usb interface. Not done by default.\n"
+            "      --status[=name]  print current profile number (and name), only\n"
+            "      --all            apply to every attached mouse (in parallel)\n"
+            "      --no-flash       don't save changes to flash memory\n"
+            "      --soak=N         soak test: N read/write/verify/switch cycles\n"
+            "      --simulate[=F]   use a simulated device (F: fault percentage)\n"
+            "      --lock-timeout=S wait at most S seconds for a busy device (%d)\n"
+            "      --no-lock        don't serialize with other %s instances\n"
+            "      --keep-awake     disable usb autosuspend during session\n"
+            "      --any-id         accept answers not carrying the request id\n"
+            "      --dry-run        print bus transactions plan, don't touch device\n"
+            "      --live           apply key=value lines from stdin (c1=800, ...)\n"
+            "      --flash-delay=MS --live: save to flash after MS ms without change (%d)\n"
+            "      --apply=FILE     set profiles as described in FILE (only what differs)\n"
+            "      --watch=SEC      check profiles every SEC s, report drift from start\n"
+            "      --watch-fix      --watch: write drifted settings back\n"
+            "      --save=NAME      store profile into host bank as NAME\n"
+            "      --load=NAME      write bank entry NAME into profile (what differs)\n"
+            "      --bank           list host bank entries\n"
+            "      --raw=FILE       run raw packet script (set/get/wait/delay), timed\n"
+            "      --timings[=FILE] print time spent per phase (or append it to FILE)\n"
+            "      --pace=N         at most N transfers per input polling interval\n"
+            "                       (0: no limit), report input report timing\n"
+            "      --shell          interactive commands on one session (show, set, ...)\n"
+            "      --daemon         serve requests on %s (socket activated)\n"
+            "      --idle-timeout=S --daemon: release device and exit after S s idle (%d)\n"
             "      --version        print version of this program\n"
             "  -h, --help           show this help message and exit\n",
         XAI_MOUSE_PROGRAM_NAME,
@@ -1169,15 +6085,29 @@ static void help(void)
         XAI_MOUSE_FREEMOVE_MIN, XAI_MOUSE_FREEMOVE_MAX,
         XAI_MOUSE_AIM_MIN, XAI_MOUSE_AIM_MAX,
         XAI_MOUSE_LCD_BRIGHTNESS_MIN, XAI_MOUSE_LCD_BRIGHTNESS_MAX,
-        XAI_MOUSE_LCD_CONTRAST_MIN, XAI_MOUSE_LCD_CONTRAST_MAX);
+        XAI_MOUSE_LCD_CONTRAST_MIN, XAI_MOUSE_LCD_CONTRAST_MAX,
+        XAI_LOCK_TIMEOUT, XAI_MOUSE_PROGRAM_NAME, XAI_LIVE_FLASH_DELAY,
+        XAI_DAEMON_SOCKET, XAI_DAEMON_IDLE);
 }
 
 
 int main(int argc, char *argv[])
 {
-    int c, ret, profile_number;
+    unsigned long long start = xai_time_us();
+    int c, i, ret, profile_number;
+    unsigned int targets = 1;
+    unsigned long field;
     static struct xai_context ctx;
+    static struct xai_profile desired[XAI_MOUSE_PROFILE_NUM];
+    static struct xai_raw_step raw_steps[XAI_RAW_STEP_MAX];
+    static struct xai_input_monitor monitor;
+    int pacing = 0;
+    int raw_count = 0;
+    int forwarded = 0, answers;
+    int opened = 0;
     struct xai_profile newp;
+    char changes[XAI_DAEMON_REQ_MAX], request[XAI_DAEMON_REQ_MAX];
+    int changes_len = 0, len;
 
     int option_index = 0;
 
@@ -1186,6 +6116,30 @@ int main(int argc, char *argv[])
         {"debug",    no_argument, &ctx.usb_debug, 1},
         {"rebind",   no_argument, &ctx.usb_rebind, 1},
         {"current",  no_argument, &ctx.set_current_profile, 1},
+        {"all",      no_argument, &ctx.fleet, 1},
+        {"status",   optional_argument, 0, 's'},
+        {"no-flash", no_argument, &ctx.no_flash, 1},
+        {"soak",     required_argument, 0, 'K'},
+        {"simulate", optional_argument, 0, 'S'},
+        {"no-lock",  no_argument, &ctx.no_lock, 1},
+        {"keep-awake", no_argument, &ctx.keep_awake, 1},
+        {"any-id",   no_argument, &ctx.any_id, 1},
+        {"dry-run",  no_argument, &ctx.dry_run, 1},
+        {"live",     no_argument, &ctx.live, 1},
+        {"flash-delay", required_argument, 0, 'D'},
+        {"apply",    required_argument, 0, 'A'},
+        {"daemon",   no_argument, &ctx.daemon, 1},
+        {"shell",    no_argument, &ctx.shell, 1},
+        {"idle-timeout", required_argument, 0, 'I'},
+        {"watch",    required_argument, 0, 'W'},
+        {"watch-fix", no_argument, &ctx.watch_fix, 1},
+        {"save",     required_argument, 0, 'B'},
+        {"load",     required_argument, 0, 'L'},
+        {"bank",     no_argument, &ctx.bank_list, 1},
+        {"raw",      required_argument, 0, 'R'},
+        {"timings",  optional_argument, 0, 'G'},
+        {"pace",     required_argument, 0, 'P'},
+        {"lock-timeout", required_argument, 0, 'T'},
         {"version",  no_argument, 0, 'v'},
         {"help",     no_argument, 0, 'h'},
         {"rate",     required_argument, 0, PROFILE_FIELD_RATE},
@@ -1216,30 +6170,119 @@ int main(int argc, char *argv[])
     }
 
     memset(&newp, 0, sizeof(struct xai_profile));
+    ctx.lock_timeout = XAI_LOCK_TIMEOUT;
+    ctx.flash_delay = XAI_LIVE_FLASH_DELAY;
+    ctx.idle_timeout = XAI_DAEMON_IDLE;
 
     while ((c = getopt_long(argc, argv, "n:f:c:r:a:hv", long_options,
                     &option_index)) != -1) {
+        field = 0;
+
         switch (c & PROFILE_FIELD_MASK) {
             case 0:
                 break;
 
             case (PROFILE_FIELD_MASK ^ 0xFF):
-                ret = xai_profile_change_req(&newp, (unsigned long)c, optarg);
+                field = (unsigned long)c;
                 break;
             case 'c':
-                ret = xai_profile_change_req(&newp, PROFILE_FIELD_CPI1, optarg);
+                field = PROFILE_FIELD_CPI1;
                 break;
             case 'r':
-                ret = xai_profile_change_req(&newp, PROFILE_FIELD_RATE, optarg);
+                field = PROFILE_FIELD_RATE;
                 break;
             case 'a':
-                ret = xai_profile_change_req(&newp, PROFILE_FIELD_ACCEL, optarg);
+                field = PROFILE_FIELD_ACCEL;
                 break;
             case 'f':
-                ret = xai_profile_change_req(&newp, PROFILE_FIELD_FREEMOVE, optarg);
+                field = PROFILE_FIELD_FREEMOVE;
                 break;
             case 'n':
-                ret = xai_profile_change_req(&newp, PROFILE_FIELD_NAME, optarg);
+                field = PROFILE_FIELD_NAME;
+                break;
+
+            case 'K':
+                ctx.soak = atoi(optarg);
+                if (ctx.soak <= 0) {
+                    fprintf(stderr, "%s: invalid number of soak cycles\n",
+                            XAI_MOUSE_PROGRAM_NAME);
+                    return -1;
+                }
+                break;
+            case 'T':
+                ctx.lock_timeout = atoi(optarg);
+                break;
+            case 'D':
+                ctx.flash_delay = atoi(optarg);
+                if (ctx.flash_delay < 0) {
+                    fprintf(stderr, "%s: invalid flash delay\n",
+                            XAI_MOUSE_PROGRAM_NAME);
+                    return -1;
+                }
+                break;
+            case 'A':
+                ctx.apply_file = optarg;
+                break;
+            case 'B':
+                ctx.bank_save = optarg;
+                break;
+            case 'L':
+                ctx.bank_load = optarg;
+                break;
+            case 'R':
+                ctx.raw_file = optarg;
+                break;
+            case 'G':
+                ctx.timings = 1;
+                ctx.timings_file = optarg;
+                break;
+            case 'P':
+                ctx.pace = atoi(optarg);
+                if (ctx.pace < 0) {
+                    fprintf(stderr, "%s: invalid pace\n",
+                            XAI_MOUSE_PROGRAM_NAME);
+                    return -1;
+                }
+                pacing = 1;
+                break;
+            case 'I':
+                ctx.idle_timeout = atoi(optarg);
+                if (ctx.idle_timeout <= 0) {
+                    fprintf(stderr, "%s: invalid idle timeout\n",
+                            XAI_MOUSE_PROGRAM_NAME);
+                    return -1;
+                }
+                break;
+            case 'W':
+                ctx.watch = atoi(optarg);
+                if (ctx.watch <= 0) {
+                    fprintf(stderr, "%s: invalid watch interval\n",
+                            XAI_MOUSE_PROGRAM_NAME);
+                    return -1;
+                }
+                break;
+            case 's':
+                ctx.status = 1;
+                if (optarg) {
+                    if (strcmp(optarg, "name") != 0) {
+                        fprintf(stderr, "%s: invalid status format (%s)\n",
+                                XAI_MOUSE_PROGRAM_NAME, optarg);
+                        return -1;
+                    }
+                    ctx.status = 2;
+                }
+                break;
+            case 'S':
+                ctx.simulate = 1;
+                if (optarg) {
+                    ctx.sim_fault_rate = atoi(optarg);
+                    if (ctx.sim_fault_rate < 0 || ctx.sim_fault_rate > 100 ||
+                            strspn(optarg, "0123456789") != strlen(optarg)) {
+                        fprintf(stderr, "%s: invalid fault percentage "
+                                "(0 - 100)\n", XAI_MOUSE_PROGRAM_NAME);
+                        return -1;
+                    }
+                }
                 break;
 
             case 'h':
@@ -1254,72 +6297,320 @@ int main(int argc, char *argv[])
                         XAI_MOUSE_PROGRAM_NAME, c, XAI_MOUSE_PROGRAM_NAME);
                 return -1;
         }
+
+        /* Valid changes are kept as text too, for the daemon */
+        if (field != 0) {
+            xai_profile_change_req(&newp, field, optarg);
+            if ((newp.fields & field) == field &&
+                    changes_len < (int)sizeof(changes))
+                changes_len += snprintf(changes + changes_len,
+                        sizeof(changes) - changes_len, " %s=%s",
+                        xai_field_name(field), optarg);
+        }
     }
 
-    if (optind >= argc) {
+    if (ctx.bank_list)
+        return (xai_bank_list(stdout) == RET_OK) ? 0 : -1;
+
+    if (optind < argc) {
+        if (xai_profile_list_parse(argv[optind], &targets) != RET_OK) {
+            fprintf(stderr, "%s: invalid profile number. Must be from 1 to %d "
+                    "(list: 1,3-5 or all).\n", XAI_MOUSE_PROGRAM_NAME,
+                    XAI_MOUSE_PROFILE_NUM);
+            return -1;
+        }
+    } else if (ctx.watch) {
+        targets = (1 << XAI_MOUSE_PROFILE_NUM) - 1;
+    } else if (!ctx.status && !ctx.apply_file && !ctx.daemon && !ctx.shell &&
+            !ctx.raw_file) {
         fprintf(stderr, "%s: missing profile number\n", XAI_MOUSE_PROGRAM_NAME);
         return -1;
     }
 
-    profile_number = atoi(argv[optind]);
+    if (ctx.watch && (newp.fields != 0 || ctx.set_current_profile ||
+                ctx.soak || ctx.live || ctx.status || ctx.fleet ||
+                ctx.dry_run)) {
+        fprintf(stderr, "%s: --watch can only be combined with --apply\n",
+                XAI_MOUSE_PROGRAM_NAME);
+        return -1;
+    }
+
+    if (ctx.apply_file) {
+        if (newp.fields != 0 || ctx.set_current_profile || ctx.soak ||
+                ctx.live || ctx.status || ctx.fleet) {
+            fprintf(stderr, "%s: --apply can't be combined with other "
+                    "changes or modes\n", XAI_MOUSE_PROGRAM_NAME);
+            return -1;
+        }
+        if (xai_config_load(ctx.apply_file, desired) != RET_OK)
+            return -1;
+    }
 
-    if (profile_number <= 0 || profile_number > XAI_MOUSE_PROFILE_NUM) {
-        fprintf(stderr, "%s: invalid profile number. Must be from 1 to %d.\n",
-                XAI_MOUSE_PROGRAM_NAME, XAI_MOUSE_PROFILE_NUM);
+    if (ctx.simulate && ctx.fleet) {
+        fprintf(stderr, "%s: --simulate can't be combined with --all\n",
+                XAI_MOUSE_PROGRAM_NAME);
         return -1;
     }
-    profile_number--;
 
-    if ((ret = xai_init(XAI_MOUSE_VENDOR_ID, XAI_MOUSE_PRODUCT_ID,
-                    XAI_MOUSE_INTERFACE_NUM, &ctx)) != RET_OK) {
-        fprintf(stderr, "%s: error in xai_init (%d)\n",
-                XAI_MOUSE_PROGRAM_NAME, ret);
+    if ((ctx.timings || pacing) && ctx.fleet) {
+        fprintf(stderr, "%s: --timings and --pace can't be combined with "
+                "--all\n", XAI_MOUSE_PROGRAM_NAME);
         return -1;
     }
 
-    if ((ret = xai_device_init(&ctx)) != RET_OK) {
-        fprintf(stderr, "%s: error in xai_device_init (%d)\n",
-                XAI_MOUSE_PROGRAM_NAME, ret);
-        xai_uninit(&ctx);
-        return -2;
+    if (ctx.raw_file) {
+        if (newp.fields != 0 || ctx.set_current_profile || ctx.soak ||
+                ctx.live || ctx.status || ctx.fleet || ctx.dry_run ||
+                ctx.apply_file || ctx.watch || ctx.daemon || ctx.shell ||
+                ctx.bank_save || ctx.bank_load || optind < argc) {
+            fprintf(stderr, "%s: --raw can't be combined with a profile, "
+                    "other changes or modes\n", XAI_MOUSE_PROGRAM_NAME);
+            return -1;
+        }
+        if (xai_raw_load(ctx.raw_file, raw_steps, &raw_count) != RET_OK)
+            return -1;
     }
 
-    if ((newp.fields != 0) || (ctx.set_current_profile)) {
-        ret = xai_profile_set_config (&ctx, profile_number, &newp);
-        if (ret == RET_OK) {
+    if (ctx.bank_save || ctx.bank_load) {
+        if (newp.fields != 0 || ctx.soak || ctx.live || ctx.status ||
+                ctx.fleet || ctx.apply_file || ctx.watch || ctx.daemon ||
+                ctx.shell || (ctx.bank_save && ctx.bank_load) ||
+                (ctx.bank_save && (ctx.set_current_profile || ctx.dry_run))) {
+            fprintf(stderr, "%s: --save and --load can't be combined with "
+                    "other changes or modes\n", XAI_MOUSE_PROGRAM_NAME);
+            return -1;
+        }
+        if (targets & (targets - 1)) {
+            fprintf(stderr, "%s: --save and --load need a single profile "
+                    "number\n", XAI_MOUSE_PROGRAM_NAME);
+            return -1;
+        }
+    }
 
-            /* if current changeset apply to current profile, reload it */
-            if ((profile_number == ctx.cur_index) || (ctx.set_current_profile)) {
-                ret = xai_profile_set_current_index(&ctx, profile_number);
-                if (ret != RET_OK)
-                    fprintf(stderr, "%s: error in xai_profile_set_current_index (%d)\n",
-                            XAI_MOUSE_PROGRAM_NAME, ret);
-            }
+    /* first (or single) profile */
+    for (profile_number = 0; !(targets & (1 << profile_number)); )
+        profile_number++;
 
-            if ((newp.fields & PROFILE_FIELD_NAME) == PROFILE_FIELD_NAME) {
-                ret = xai_profile_set_name(&ctx, profile_number, &newp);
-                if (ret != RET_OK)
-                    fprintf(stderr, "%s: error in xai_profile_set_name (%d)\n",
-                            XAI_MOUSE_PROGRAM_NAME, ret);
-            }
+    if ((targets & (targets - 1)) &&
+            (ctx.soak || ctx.live || ctx.set_current_profile)) {
+        fprintf(stderr, "%s: --soak, --live and --current need a single "
+                "profile number\n", XAI_MOUSE_PROGRAM_NAME);
+        return -1;
+    }
 
-            ret = xai_device_write_to_flash(&ctx);
-            if (ret != RET_OK)
-                fprintf(stderr, "%s: error in xai_device_write_to_flash (%d)\n",
-                        XAI_MOUSE_PROGRAM_NAME, ret);
+    if ((ctx.daemon || ctx.shell) && (newp.fields != 0 ||
+                ctx.set_current_profile || ctx.soak || ctx.live ||
+                ctx.status || ctx.fleet || ctx.dry_run || ctx.apply_file ||
+                ctx.watch || (ctx.daemon && ctx.shell))) {
+        fprintf(stderr, "%s: --daemon and --shell can't be combined with a "
+                "command\n", XAI_MOUSE_PROGRAM_NAME);
+        return -1;
+    }
 
-        } else {
-            fprintf(stderr, "%s: error in xai_profile_set_config (%d)\n",
-                    XAI_MOUSE_PROGRAM_NAME, ret);
+    ctx.read_only = (newp.fields == 0) && !ctx.set_current_profile &&
+        !ctx.soak && !ctx.live && !ctx.apply_file && !ctx.watch &&
+        !ctx.daemon && !ctx.shell && !ctx.bank_save && !ctx.bank_load &&
+        !ctx.raw_file;
+
+    /*
+     * Simple commands are served by the daemon, when there is one. Cold
+     * --status is faster direct (2 requests, no full state read).
+     */
+    if (!ctx.daemon && !ctx.shell && !ctx.simulate && !ctx.fleet &&
+            !ctx.soak && !ctx.live && !ctx.dry_run && !ctx.apply_file &&
+            !ctx.watch && !ctx.no_flash && !ctx.bank_save && !ctx.bank_load &&
+            !ctx.raw_file && !ctx.timings && !pacing &&
+            changes_len < (int)sizeof(changes) &&
+            (!ctx.status || xai_daemon_running()) &&
+            (ret = xai_client_connect()) >= 0) {
+        if (ctx.status)
+            len = snprintf(request, sizeof(request), "status%s\n",
+                    (ctx.status == 2) ? " name" : "");
+        else if (ctx.read_only)
+            len = snprintf(request, sizeof(request), "show %s\n",
+                    argv[optind]);
+        else
+            len = snprintf(request, sizeof(request), "%s%s%s%s%s%s%s",
+                    changes_len ? "set " : "",
+                    changes_len ? argv[optind] : "",
+                    changes_len ? changes : "", changes_len ? "\n" : "",
+                    ctx.set_current_profile ? "switch " : "",
+                    ctx.set_current_profile ? argv[optind] : "",
+                    ctx.set_current_profile ? "\n" : "");
+
+        if (len == 0 || len >= (int)sizeof(request)) {
+            close(ret);
+            if (len == 0)
+                return 0;      /* no valid change */
+            fprintf(stderr, "%s: request too long\n", XAI_MOUSE_PROGRAM_NAME);
+            return -1;
         }
 
-    } else {
-        xai_profile_print(stdout, &ctx.p[profile_number],
-                profile_number == ctx.cur_index);
+        ret = xai_client_request(ret, request, &answers);
+        if (answers > 0)
+            return (ret == RET_OK) ? 0 : -2;
+
+        /* Daemon couldn't serve it (no device?): go on without it */
+        if (ctx.usb_debug)
+            fprintf(stderr, "%s: no answer from daemon (%s)\n",
+                    XAI_MOUSE_PROGRAM_NAME, XAI_DAEMON_SOCKET);
+        forwarded = 1;
+    }
+
+    /* --apply and --load: plan depends on device state (and bank) */
+    if (ctx.dry_run && !ctx.apply_file && !ctx.bank_load) {
+        struct xai_plan plan;
+
+        if (ctx.soak || ctx.status) {
+            fprintf(stderr, "%s: --dry-run only applies to profile print or "
+                    "changes\n", XAI_MOUSE_PROGRAM_NAME);
+            return -1;
+        }
+
+        xai_plan_build(&ctx, targets, ctx.read_only ? NULL : &newp, &plan);
+        xai_plan_print(stdout, &plan);
+        return 0;
+    }
+
+    /* Not forwarded: a running daemon holds the device, have it released */
+    if (!ctx.daemon && !ctx.simulate && !forwarded && xai_daemon_running() &&
+            (ret = xai_client_connect()) >= 0)
+        xai_client_request(ret, "release\n", &answers);
+
+    if (ctx.fleet && ctx.status) {
+        ret = xai_fleet_status(&ctx);
+        if (ret == RET_ERROR_NO_DEVICE_FOUND)
+            fprintf(stderr, "%s: no device found\n", XAI_MOUSE_PROGRAM_NAME);
+        return (ret == RET_OK) ? 0 : -2;
+    }
+
+    if (ctx.fleet) {
+        ret = xai_fleet_run(&ctx, targets, &newp);
+        if (ret == RET_ERROR_NO_DEVICE_FOUND)
+            fprintf(stderr, "%s: no device found\n", XAI_MOUSE_PROGRAM_NAME);
+        return (ret == RET_OK) ? 0 : -2;
+    }
+
+    /* Before xai_init: driver detach makes the pointer stutter too */
+    if (pacing)
+        xai_input_start(&monitor, &ctx);
+
+    if (ctx.simulate)
+        ret = xai_sim_init(ctx.sim_fault_rate, &ctx);
+    else
+        ret = xai_init(XAI_MOUSE_VENDOR_ID, XAI_MOUSE_PRODUCT_ID,
+                XAI_MOUSE_INTERFACE_NUM, &ctx);
+
+    if (ret == RET_COALESCED) {
+        if (ctx.status)
+            xai_device_status_print(stdout, &ctx, ctx.status == 2);
+        else
+            for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++)
+                if (targets & (1 << i))
+                    xai_profile_print(stdout, &ctx.p[i], i == ctx.cur_index);
+        ret = 0;
+        goto out;
+    }
+
+    if (ret == RET_ERROR_NO_DEVICE_FOUND) {
+        fprintf(stderr, "%s: no device found\n", XAI_MOUSE_PROGRAM_NAME);
+        ret = -1;
+        goto out;
+    } else if (ret != RET_OK) {
+        fprintf(stderr, "%s: error in xai_init (%d)\n",
+                XAI_MOUSE_PROGRAM_NAME, ret);
+        ret = -1;
+        goto out;
+    }
+    opened = 1;
+
+    xai_phase_begin(&ctx);
+    ret = xai_journal_recover(&ctx);
+    xai_phase_end(&ctx, XAI_PHASE_JOURNAL, 0);
+    if (ret != RET_OK) {
+        fprintf(stderr, "%s: error in xai_journal_recover (%d)\n",
+                XAI_MOUSE_PROGRAM_NAME, ret);
+        /* Don't build (and commit) changes on top of a partial one */
+        if (!ctx.read_only && !ctx.status) {
+            ret = -2;
+            goto out;
+        }
+    }
+
+    if (ctx.status) {
+        ret = xai_device_status(&ctx, ctx.status == 2);
+        if (ret == RET_OK)
+            xai_device_status_print(stdout, &ctx, ctx.status == 2);
+        else
+            fprintf(stderr, "%s: error in xai_device_status (%d)\n",
+                    XAI_MOUSE_PROGRAM_NAME, ret);
+        ret = (ret == RET_OK) ? 0 : -2;
+        goto out;
+    }
+
+    /* A change only reads what its plan needs */
+    if ((ctx.read_only || ctx.soak || ctx.live || ctx.apply_file ||
+                ctx.watch || ctx.daemon || ctx.shell) &&
+            ((ret = xai_device_init(&ctx)) != RET_OK)) {
+        fprintf(stderr, "%s: error in xai_device_init (%d)\n",
+                XAI_MOUSE_PROGRAM_NAME, ret);
+        ret = -2;
+        goto out;
+    }
+
+    /* Monitor started before the state was read, with 1 ms interval */
+    if (pacing)
+        monitor.interval_us = xai_pace_interval(&ctx);
+
+    if (ctx.apply_file) {
+        if (xai_config_apply(&ctx, desired) != RET_OK)
+            ret = -2;
+    } else if (ctx.raw_file) {
+        if (xai_raw_run(&ctx, raw_steps, raw_count) != RET_OK)
+            ret = -2;
+    } else if (ctx.bank_save) {
+        if (xai_bank_save(&ctx, ctx.bank_save, profile_number) != RET_OK)
+            ret = -2;
+    } else if (ctx.bank_load) {
+        ret = xai_bank_load(&ctx, ctx.bank_load, profile_number, stdout);
+        ret = (ret >= 0) ? 0 : -2;
+    } else if (ctx.daemon) {
+        if (xai_daemon_run(&ctx) != RET_OK)
+            ret = -2;
+        /* Give interface back to usbhid on exit */
+        ctx.usb_rebind = 1;
+    } else if (ctx.shell) {
+        if (xai_shell_run(&ctx) != RET_OK)
+            ret = -2;
+    } else if (ctx.soak) {
+        if (xai_soak_run(&ctx, profile_number, ctx.soak) != RET_OK)
+            ret = -2;
+    } else if (ctx.live) {
+        if (xai_live_run(&ctx, profile_number, &newp) != RET_OK)
+            ret = -2;
+    } else if ((newp.fields != 0) || (ctx.set_current_profile)) {
+        if (xai_profile_apply(&ctx, targets, &newp) != RET_OK)
+            ret = -2;
+    } else if (!ctx.watch && !ctx.daemon && !ctx.shell) {
+        for (i = 0; i < XAI_MOUSE_PROFILE_NUM; i++)
+            if (targets & (1 << i))
+                xai_profile_print(stdout, &ctx.p[i], i == ctx.cur_index);
     }
 
-    xai_uninit(&ctx);
+    /* Device is released between checks */
+    if (ctx.watch && ret == RET_OK) {
+        ret = (xai_watch_run(&ctx, targets) == RET_OK) ? 0 : -2;
+        opened = 0;
+    }
+
+out:
+    if (opened)
+        xai_uninit(&ctx);
+    /* After xai_uninit: driver reattach is measured as well */
+    if (pacing)
+        xai_input_stop(&monitor, &ctx);
+    xai_timings_report(&ctx, start);
 
-    return 0;
+    return ret;
 }
 // vim: set sw=4 et fenc=utf-8: